@@ -13,6 +13,9 @@
 
 #include "../../kernel.h"
 
+// Interrupt enable flag in EFLAGS.
+#define EFLAGS_IF 0x00000200
+
 static inline void outb(u16 port, u8 data)
 {
     asm (
@@ -79,6 +82,68 @@ static inline u32 inl(u16 port)
     return ret;
 }
 
+// Reads `count` words from `port` into `buf`.
+static inline void insw(u16 port, void *buf, u32 count)
+{
+    asm (
+        "rep insw"
+        : "+D"(buf), "+c"(count)
+        : "d"(port)
+        : "memory"
+    );
+}
+
+// Writes `count` words from `buf` to `port`.
+static inline void outsw(u16 port, const void *buf, u32 count)
+{
+    asm (
+        "rep outsw"
+        : "+S"(buf), "+c"(count)
+        : "d"(port)
+        : "memory"
+    );
+}
+
+static inline void cpuid(u32 leaf, u32 subleaf, u32 *eax, u32 *ebx,
+        u32 *ecx, u32 *edx)
+{
+    asm volatile (
+        "cpuid"
+        : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+        : "a"(leaf), "c"(subleaf)
+    );
+}
+
+static inline u32 read_cr0(void)
+{
+    u32 ret;
+    asm volatile ("mov %%cr0, %0" : "=r"(ret));
+    return ret;
+}
+
+static inline void write_cr0(u32 val)
+{
+    asm volatile ("mov %0, %%cr0" : : "r"(val) : "memory");
+}
+
+static inline u32 read_cr4(void)
+{
+    u32 ret;
+    asm volatile ("mov %%cr4, %0" : "=r"(ret));
+    return ret;
+}
+
+static inline void write_cr4(u32 val)
+{
+    asm volatile ("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+// Clears the task switched flag in CR0.
+static inline void clts()
+{
+    asm volatile ("clts" ::: "memory");
+}
+
 static inline void hlt()
 {
     asm ("hlt");
@@ -89,4 +154,9 @@ static inline void sti()
     asm ("sti");
 }
 
+static inline void cli()
+{
+    asm ("cli");
+}
+
 #endif
@@ -9,8 +9,11 @@
  * at your option, any later version. See LICENSE file for details.
  */
 #include "../../../kernel.h"
+#include "../../../buf.h"
 #include "../../../fs/ext2/ext2.h"
+#include "../../../lz4.h"
 #include "../asm.h"
+#include "../fpu.h"
 #include "../idt.h"
 #include "../pc/pc.h"
 #include "grub/multiboot2.h"
@@ -37,25 +40,167 @@ static void *find_info(multiboot_info *info, u32 type)
     return 0;
 }
 
+static bool streq(const char *a, const char *b)
+{
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// Whether the command line word at `p` is `word`.
+static bool wordeq(const char *p, const char *word)
+{
+    while (*word && *p == *word) {
+        p++;
+        word++;
+    }
+    return !*word && (*p == ' ' || *p == 0);
+}
+
+// Picks the console outputs from the kernel command line: "console=vga" or
+// "console=serial" for just one of them, both otherwise.
+static void console_select(multiboot_info *info)
+{
+    struct multiboot_tag_string *cmdline = find_info(info,
+            MULTIBOOT_TAG_TYPE_CMDLINE);
+    if (!cmdline) {
+        return;
+    }
+    for (const char *p = cmdline->string; *p; p++) {
+        if (p != cmdline->string && p[-1] != ' ') {
+            continue;
+        }
+        if (wordeq(p, "console=vga")) {
+            console_setoutputs(CONSOLE_VGA);
+        } else if (wordeq(p, "console=serial")) {
+            console_setoutputs(CONSOLE_SERIAL);
+        }
+    }
+}
+
+// Finds free memory past `after` (and past the boot information, which may
+// be there too). Returns its start and sets `cap` to its size.
+static char *freemem(multiboot_info *info, u32 after, u32 *cap)
+{
+    u32 start = after;
+    u32 infoend = (u32)info + info->total_size;
+    if (infoend > start) {
+        start = infoend;
+    }
+    start = (start + 4095) & ~4095;
+
+    struct multiboot_tag_mmap *mmap = find_info(info, MULTIBOOT_TAG_TYPE_MMAP);
+    if (!mmap) {
+        *cap = 0;
+        return 0;
+    }
+    for (u32 off = sizeof *mmap; off < mmap->size; off += mmap->entry_size) {
+        struct multiboot_mmap_entry *e = (void*)mmap + off;
+        u64 end = e->addr + e->len;
+        if (e->type == MULTIBOOT_MEMORY_AVAILABLE && e->addr <= start &&
+                start < end) {
+            if (end > 0xffffffffu) {
+                end = 0xffffffffu;
+            }
+            *cap = end - start;
+            return (char*)start;
+        }
+    }
+    *cap = 0;
+    return 0;
+}
+
+// Sets up the RAM disk from the boot module. An LZ4 compressed module is
+// decompressed to the memory following it: all at once, or a frame block at
+// a time as it is accessed if the module's command line is "lazy".
+static bool initrd_init(blkdev *dev, multiboot_info *info,
+        struct multiboot_tag_module *mod)
+{
+    char *image = (char*)mod->mod_start;
+    u32 size = mod->mod_end - mod->mod_start;
+    lz4_frame f;
+    if (!lz4_isframe(image, size)) {
+        ramdisk_init(dev, "initrd", image, size);
+        return true;
+    }
+    if (!lz4_open(&f, image, size)) {
+        return false;
+    }
+
+    u32 cap;
+    char *mem = freemem(info, mod->mod_end, &cap);
+    if (f.hassize && f.size > cap) {
+        printf("Error: initrd: %u KiB don't fit in memory\n",
+                (u32)(f.size >> 10));
+        return false;
+    }
+
+    u32 start = ticks();
+    if (streq(mod->cmdline, "lazy") && f.independent) {
+        if (!lzdisk_init(dev, "initrd", &f, mem, cap)) {
+            return false;
+        }
+        printf("initrd: LZ4, %u KiB, decompressed on demand\n", size >> 10);
+        return true;
+    }
+
+    s32 n = lz4_decodeframe(&f, (u8*)mem, cap);
+    if (n < 0) {
+        return false;
+    }
+    ramdisk_init(dev, "initrd", mem, n);
+    printf("initrd: LZ4, %u KiB to %u KiB in %u ms\n", size >> 10, n >> 10,
+            ticks() - start);
+    return true;
+}
+
 // Called from _start.
 void kmain(multiboot_info *info)
 {
+    console_select(info);
     puts("Hello, world!\n");
 
+    idt_init();
+    fpu_init();
+    pic_init(32);
+    pit_init();
+    uart_init();
+    sti();
+
+    // Disk drivers sleep until their interrupts, so they come after sti().
+    virtblk_init();
+    ata_init();
+
     // Find the RAM disk.
     struct multiboot_tag_module *moduleinfo = find_info(info,
             MULTIBOOT_TAG_TYPE_MODULE);
     printf("Module start: %x\n", moduleinfo->mod_start);
 
+    u32 start = ticks();
+    static blkdev initrd;
+    bool haveinitrd = initrd_init(&initrd, info, moduleinfo);
+
+    // Use the first disk if it holds a filesystem, the RAM disk otherwise.
     ext2fs fs;
-    ext2_inode ino;
-    bool success = ext2_fsopen(&fs, (char*)moduleinfo->mod_start);
-    success = ext2_readinode(&fs, &ino, 2);
+    blkdev *disk = virtblk_getdev();
+    if (!disk) {
+        disk = ata_getdev(0);
+    }
+    bool success = (disk && ext2_fsopen(&fs, disk)) ||
+            (haveinitrd && ext2_fsopen(&fs, &initrd));
+    if (success) {
+        printf("Mounted %s in %u ms\n", fs.dev->name, ticks() - start);
 
-    idt_init();
-    pic_init(32);
-    pit_init();
-    sti();
+        // Get the root directory.
+        ext2_incore *root = ext2_iget(&fs, 2);
+        if (root) {
+            printf("Root: mode %4o, size %u, first block %u\n",
+                    root->inode.mode, root->inode.size_lo,
+                    root->inode.blocks[0]);
+        }
+    }
 
     char a[] = "0";
     while (1) {
@@ -2,7 +2,7 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
  * arch/i686/console.c
- * VGA text mode console driver
+ * Kernel console on VGA text mode and the serial port
  * 
  * Copyright (C) 2024-present Ben Matthies
  * This is free software under the GNU General Public License, version 3, or,
@@ -12,13 +12,17 @@
 
 #include <stdarg.h>
 
+#include "../../mem.h"
 #include "asm.h"
+#include "pc/pc.h"
 
 // IO Ports
 #define VGA_INDEX 0x03d4
 #define VGA_DATA 0x03d5
 
 // VGA indexed registers addressed via the VGA_INDEX IO port.
+#define START_ADDR_HIGH 0x0c
+#define START_ADDR_LOW 0x0d
 #define CURSOR_POS_HIGH 0x0e
 #define CURSOR_POS_LOW 0x0f
 
@@ -27,15 +31,64 @@
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 
+// The text mode window at VGA_BUFFER is 32 KiB, and the screen shows the 25
+// lines at the CRTC start address, so there is room for 204 lines. To scroll
+// we move the start address down a line. Only when the screen would run past
+// the end of the window is it copied back to the start.
+#define WINDOW_LINES (0x8000 / (VGA_WIDTH * 2))
+
+// Lines that scrolled off the screen, kept in RAM.
+#define SCROLLBACK 256
+
+// Light grey on black.
+#define BLANK_ATTR 0x07
+
 typedef struct {
     u8 character;   // Character code point.
     u8 attribute;   // Color and blink attribute.
 } vga_entry;
 
-static volatile vga_entry *buffer = (vga_entry*)VGA_BUFFER;
+static volatile vga_entry *framebuffer = (vga_entry*)VGA_BUFFER;
+
+// Characters go to a copy of the screen in RAM, and the lines that changed
+// are copied to the framebuffer in one go on the next timer tick, as are
+// cursor moves and scrolling. Each framebuffer access and port write may trap
+// to the hypervisor, which otherwise happens for every character. Output made
+// with interrupts disabled (when no tick may come) is flushed right away. The
+// shadow buffer is only touched with interrupts disabled.
+//
+// The shadow buffer is a ring of lines, the top line of the screen being
+// line `first`, so scrolling it doesn't move anything either.
+static vga_entry shadow[VGA_HEIGHT][VGA_WIDTH];
+static u8 first;
+static bool loaded;
 
 static u8 row, col;
 
+// Lines [dirtylo, dirtyhi) of the screen differ from the framebuffer.
+static u8 dirtylo = VGA_HEIGHT, dirtyhi;
+
+// Window line shown at the top of the screen, and how many lines the shadow
+// buffer has scrolled since.
+static u32 top;
+static u32 scrolled;
+
+// Lines `back` lines up in the scrollback are shown instead while `back` is
+// not 0.
+static u32 back;
+
+static vga_entry history[SCROLLBACK][VGA_WIDTH];
+static u32 histnext;    // Where the next line goes.
+static u32 nhist;
+
+// Register pair values last written; more than 16 bits if unknown.
+static u32 cursor = ~0u;
+static u32 start = ~0u;
+
+static unsigned outputs = CONSOLE_VGA | CONSOLE_SERIAL;
+
+static console_stats stats;
+
 // Writes to a VGA indexed register.
 static void write_register(u8 index, u8 data)
 {
@@ -43,36 +96,215 @@ static void write_register(u8 index, u8 data)
     outb(VGA_DATA, data);
 }
 
-static void move_cursor(u8 row, u8 col)
+// Writes a 16 bit value to a pair of registers, only the bytes that changed.
+static void write_pair(u8 high, u8 low, u16 val, u32 *old)
 {
-    u16 pos = (u16)row * VGA_WIDTH + col;
-    write_register(CURSOR_POS_LOW, (u8)pos);
-    write_register(CURSOR_POS_HIGH, (u8)(pos >> 8));
+    if (*old > 0xffff || (u8)val != (u8)*old) {
+        write_register(low, (u8)val);
+        stats.regs++;
+    }
+    if (*old > 0xffff || val >> 8 != *old >> 8) {
+        write_register(high, val >> 8);
+        stats.regs++;
+    }
+    *old = val;
 }
 
-static void _putchar(char ch)
+static vga_entry *line(u32 n)
+{
+    return shadow[(first + n) % VGA_HEIGHT];
+}
+
+static void blank(vga_entry *l)
+{
+    for (u32 i = 0; i < VGA_WIDTH; i++) {
+        l[i] = (vga_entry) { ' ', BLANK_ATTR };
+    }
+}
+
+static void mark(u8 n)
+{
+    if (n < dirtylo) {
+        dirtylo = n;
+    }
+    if (n >= dirtyhi) {
+        dirtyhi = n + 1;
+    }
+}
+
+// Starts from what is on the screen, so that its attributes are kept.
+static void load(void)
+{
+    memcpy(shadow, (vga_entry*)framebuffer, sizeof shadow);
+    loaded = true;
+}
+
+static void scroll(void)
+{
+    memcpy(history[histnext], line(0), sizeof history[0]);
+    histnext = (histnext + 1) % SCROLLBACK;
+    if (nhist < SCROLLBACK) {
+        nhist++;
+    }
+
+    first = (first + 1) % VGA_HEIGHT;
+    blank(line(VGA_HEIGHT - 1));
+    scrolled++;
+    stats.scrolls++;
+
+    // The lines still on the screen move up along with the start address.
+    if (dirtylo > 0) {
+        dirtylo--;
+    }
+    if (dirtyhi > 0) {
+        dirtyhi--;
+    }
+    mark(VGA_HEIGHT - 1);
+}
+
+static void newline(void)
+{
+    col = 0;
+    if (row < VGA_HEIGHT - 1) {
+        row++;
+    } else {
+        scroll();
+    }
+}
+
+static void vga_putchar(char ch)
 {
     switch (ch) {
         case '\n':
-            row++;
-            col = 0;
+            newline();
             break;
 
         default:
-            buffer[row * VGA_WIDTH + col].character = ch;
+            line(row)[col].character = ch;
+            mark(row);
             col++;
     }
 
     if (col >= VGA_WIDTH) {
-        row++;
-        col = 0;
+        newline();
     }
+}
 
-    if (row >= VGA_HEIGHT) {
-        // TODO: scrolling.
+static void _putchar(char ch)
+{
+    stats.chars++;
+    if (outputs & CONSOLE_SERIAL) {
+        if (ch == '\n') {
+            uart_putc('\r');
+        }
+        uart_putc(ch);
+    }
+    if (outputs & CONSOLE_VGA) {
+        vga_putchar(ch);
     }
 }
 
+static void flush(void)
+{
+    if (back || !(outputs & CONSOLE_VGA)) {
+        return;
+    }
+
+    if (scrolled) {
+        if (scrolled >= WINDOW_LINES ||
+                top + scrolled + VGA_HEIGHT > WINDOW_LINES) {
+            top = 0;
+            dirtylo = 0;
+            dirtyhi = VGA_HEIGHT;
+            stats.wraps++;
+        } else {
+            top += scrolled;
+        }
+        scrolled = 0;
+    }
+
+    if (dirtylo < dirtyhi) {
+        // At most two runs, as the shadow buffer is a ring.
+        for (u32 n = dirtylo; n < dirtyhi;) {
+            u32 i = (first + n) % VGA_HEIGHT;
+            u32 count = VGA_HEIGHT - i;
+            if (count > dirtyhi - n) {
+                count = dirtyhi - n;
+            }
+            memcpy((vga_entry*)&framebuffer[(top + n) * VGA_WIDTH],
+                    shadow[i], count * sizeof shadow[0]);
+            n += count;
+        }
+        stats.flushes++;
+        stats.lines += dirtyhi - dirtylo;
+        dirtylo = VGA_HEIGHT;
+        dirtyhi = 0;
+    }
+
+    write_pair(START_ADDR_HIGH, START_ADDR_LOW, top * VGA_WIDTH, &start);
+    write_pair(CURSOR_POS_HIGH, CURSOR_POS_LOW,
+            (top + row) * VGA_WIDTH + col, &cursor);
+}
+
+void console_flush(void)
+{
+    u32 flags = irqsave();
+    flush();
+    irqrestore(flags);
+}
+
+void console_setoutputs(unsigned which)
+{
+    u32 flags = irqsave();
+    if ((which & CONSOLE_VGA) && !(outputs & CONSOLE_VGA)) {
+        // The screen missed what was printed in the meantime.
+        dirtylo = 0;
+        dirtyhi = VGA_HEIGHT;
+    }
+    outputs = which;
+    irqrestore(flags);
+}
+
+void console_scrollback(u32 lines)
+{
+    u32 flags = irqsave();
+    if (!loaded) {
+        load();
+    }
+    if (lines > nhist) {
+        lines = nhist;
+    }
+
+    if (!lines) {
+        back = 0;
+        dirtylo = 0;
+        dirtyhi = VGA_HEIGHT;
+        flush();
+        irqrestore(flags);
+        return;
+    }
+
+    if (!back) {
+        flush();
+    }
+    back = lines;
+    for (u32 n = 0; n < VGA_HEIGHT; n++) {
+        const vga_entry *src = n < back ?
+                history[(histnext + SCROLLBACK - back + n) % SCROLLBACK] :
+                line(n - back);
+        memcpy((vga_entry*)&framebuffer[(top + n) * VGA_WIDTH], src,
+                sizeof history[0]);
+    }
+    irqrestore(flags);
+}
+
+void console_getstats(console_stats *out)
+{
+    u32 flags = irqsave();
+    *out = stats;
+    irqrestore(flags);
+}
+
 // Prints an unsigned integer in a given radix.
 static void _putint(unsigned n, unsigned radix, unsigned width)
 {
@@ -97,6 +329,10 @@ void printf(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    u32 flags = irqsave();
+    if (!loaded) {
+        load();
+    }
 
     char ch;
     while ((ch = *fmt++)) {
@@ -160,6 +396,12 @@ void printf(const char *fmt, ...)
 fail:
     va_end(ap);
 
-    // Only move the cursor after the entire string is written.
-    move_cursor(row, col);
+    if (outputs & CONSOLE_SERIAL) {
+        uart_start();
+    }
+    // Otherwise the next timer tick writes it out.
+    if (!(flags & EFLAGS_IF)) {
+        flush();
+    }
+    irqrestore(flags);
 }
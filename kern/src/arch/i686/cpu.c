@@ -0,0 +1,39 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/cpu.c
+ * CPU control for portable code
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "../../kernel.h"
+
+#include "asm.h"
+
+void idle(void)
+{
+    hlt();
+}
+
+u32 irqsave(void)
+{
+    u32 flags;
+    asm volatile (
+        "pushf\n"
+        "pop %0\n"
+        "cli"
+        : "=r"(flags)
+        :
+        : "memory"
+    );
+    return flags;
+}
+
+void irqrestore(u32 flags)
+{
+    if (flags & EFLAGS_IF) {
+        asm volatile ("sti" ::: "memory");
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/crc32c.c
+ * CRC-32C with the SSE4.2 crc32 instruction
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "../../crc32c.h"
+
+#include "../../kernel.h"
+#include "asm.h"
+
+// CPUID leaf 1, ECX.
+#define CPUID_SSE42 (1 << 20)
+
+// Despite being part of SSE4.2, crc32 works on general purpose registers, so
+// it needs no kernel_fpu_begin().
+static int hw = -1;     // Unknown until first needed.
+
+static bool hascrc(void)
+{
+    if (hw < 0) {
+        u32 eax, ebx, ecx, edx;
+        cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        hw = (ecx & CPUID_SSE42) != 0;
+    }
+    return hw;
+}
+
+static inline u32 crc8(u32 crc, u8 val)
+{
+    asm ("crc32b %1, %0" : "+r"(crc) : "rm"(val));
+    return crc;
+}
+
+static inline u32 crc32(u32 crc, u32 val)
+{
+    asm ("crc32l %1, %0" : "+r"(crc) : "rm"(val));
+    return crc;
+}
+
+u32 crc32c(u32 crc, const void *data, u32 len)
+{
+    if (!hascrc()) {
+        return crc32c_sw(crc, data, len);
+    }
+
+    // A dword per instruction, from the first aligned one.
+    const u8 *p = data;
+    for (; len && ((uintptr_t)p & 3); len--, p++) {
+        crc = crc8(crc, *p);
+    }
+    for (; len >= 4; len -= 4, p += 4) {
+        crc = crc32(crc, *(const u32*)p);
+    }
+    for (; len; len--, p++) {
+        crc = crc8(crc, *p);
+    }
+    return crc;
+}
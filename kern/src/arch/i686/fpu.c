@@ -0,0 +1,106 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/fpu.c
+ * FPU and SSE state
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "fpu.h"
+
+#include "../../kernel.h"
+#include "asm.h"
+#include "idt.h"
+
+#define CR0_MP 0x00000002   // WAIT honors TS.
+#define CR0_EM 0x00000004   // Emulate the FPU (fault on any FPU instruction).
+#define CR0_TS 0x00000008   // Task switched (fault on the next FPU use).
+#define CR0_NE 0x00000020   // Report FPU errors as exceptions.
+
+#define CR4_OSFXSR 0x00000200       // FXSAVE and SSE enabled.
+#define CR4_OSXMMEXCPT 0x00000400   // SSE errors as exceptions.
+
+// CPUID leaf 1, EDX.
+#define CPUID_FXSR (1 << 24)
+#define CPUID_SSE (1 << 25)
+#define CPUID_SSE2 (1 << 26)
+
+// Device not available, raised by FPU and SSE instructions while CR0.TS is
+// set.
+#define EXC_NM 7
+
+// All exceptions masked, round to nearest.
+#define MXCSR_DEFAULT 0x1f80
+
+// CR0.TS is kept set outside of kernel_fpu_begin() regions, so that SIMD
+// code that isn't in one (e.g. the compiler vectorizing a loop in a file
+// built for SSE) faults instead of silently clobbering registers. There is
+// no other owner of the FPU registers (no tasks, no user mode), so nothing
+// needs to be saved when a region starts. When there are, the fault is where
+// their registers would be switched lazily.
+static bool enabled;
+static volatile bool busy;
+
+static INTERRUPT void nm_handler(INTERRUPT_ARGS)
+{
+    printf("Error: fpu: SIMD instruction outside of kernel_fpu_begin()\n");
+    cli();
+    for (;;) {
+        hlt();
+    }
+}
+
+static inline void stts(void)
+{
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+void fpu_init(void)
+{
+    idt_set_gate(EXC_NM, gt_interrupt, 0, nm_handler);
+
+    u32 max, ebx, ecx, edx;
+    cpuid(0, 0, &max, &ebx, &ecx, &edx);
+    u32 need = CPUID_FXSR | CPUID_SSE | CPUID_SSE2;
+    u32 eax;
+    if (max >= 1) {
+        cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    }
+    if (max < 1 || (edx & need) != need) {
+        printf("fpu: no SSE2, SIMD disabled\n");
+        stts();
+        return;
+    }
+
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    u32 mxcsr = MXCSR_DEFAULT;
+    asm volatile (
+        "fninit\n"
+        "ldmxcsr %0"
+        :
+        : "m"(mxcsr)
+    );
+    stts();
+    enabled = true;
+}
+
+bool kernel_fpu_usable(void)
+{
+    return enabled && !busy;
+}
+
+void kernel_fpu_begin(void)
+{
+    //assert(kernel_fpu_usable())
+    busy = true;
+    clts();
+}
+
+void kernel_fpu_end(void)
+{
+    stts();
+    busy = false;
+}
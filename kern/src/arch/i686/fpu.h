@@ -0,0 +1,18 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/fpu.h
+ * FPU and SSE state
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#ifndef FPU_H
+#define FPU_H
+
+// Enables SSE, if the CPU has SSE2, for kernel_fpu_begin() regions. Outside
+// of them, FPU and SSE instructions fault.
+void fpu_init(void);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/mem.c
+ * Memory copy, fill and compare
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "../../mem.h"
+
+#include "../../kernel.h"
+#include "asm.h"
+
+// Copies and fills below REP bytes go a dword at a time, with plain moves (x86
+// allows unaligned ones). From there, the string instructions (rep movs,
+// rep stos) are faster, despite their startup cost. CPUs with "enhanced
+// rep movsb" (ERMS) move whole cache lines with rep movsb; others do best
+// with rep movsd into an aligned destination.
+#define REP 256
+
+// The compiler would turn the byte loops below into calls to the very
+// functions they are in.
+#define NOLIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+// CPUID leaf 7, EBX bit 9.
+#define CPUID_ERMS (1 << 9)
+
+static int erms = -1;   // Unknown until first needed.
+
+static bool fastrep(void)
+{
+    if (erms < 0) {
+        u32 max, ebx, ecx, edx;
+        cpuid(0, 0, &max, &ebx, &ecx, &edx);
+        erms = 0;
+        if (max >= 7) {
+            u32 eax;
+            cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+            erms = (ebx & CPUID_ERMS) != 0;
+        }
+    }
+    return erms;
+}
+
+NOLIBCALL
+void *(memcpy)(void *dst, const void *src, size_t n)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+    if (n < REP) {
+        for (; n >= 4; n -= 4, d += 4, s += 4) {
+            __builtin_memcpy(d, s, 4);
+        }
+        while (n--) {
+            *d++ = *s++;
+        }
+        return dst;
+    }
+
+    if (fastrep()) {
+        asm volatile (
+            "rep movsb"
+            : "+D"(d), "+S"(s), "+c"(n)
+            :
+            : "memory"
+        );
+        return dst;
+    }
+
+    // Bytes up to the first aligned dword of the destination, the dwords,
+    // then the remaining bytes.
+    size_t head = -(uintptr_t)d & 3;
+    size_t words = (n - head) >> 2;
+    size_t tail = (n - head) & 3;
+    asm volatile (
+        "rep movsb\n"
+        "mov %k[words], %%ecx\n"
+        "rep movsl\n"
+        "mov %k[tail], %%ecx\n"
+        "rep movsb"
+        : "+D"(d), "+S"(s), "+c"(head)
+        : [words]"r"(words), [tail]"r"(tail)
+        : "memory"
+    );
+    return dst;
+}
+
+NOLIBCALL
+void *(memmove)(void *dst, const void *src, size_t n)
+{
+    // Copying forwards is only wrong if the destination starts within the
+    // source.
+    if ((uintptr_t)dst - (uintptr_t)src >= n) {
+        return (memcpy)(dst, src, n);
+    }
+
+    u8 *d = dst;
+    const u8 *s = src;
+    if (n < REP) {
+        while (n >= 4) {
+            n -= 4;
+            __builtin_memcpy(&d[n], &s[n], 4);
+        }
+        while (n--) {
+            d[n] = s[n];
+        }
+        return dst;
+    }
+
+    // Backwards, with the direction flag set: the bytes past the last whole
+    // dword, then the dwords.
+    size_t tail = n & 3;
+    size_t words = n >> 2;
+    u8 *dp = d + n - 1;
+    const u8 *sp = s + n - 1;
+    asm volatile (
+        "std\n"
+        "rep movsb\n"
+        "cld"
+        : "+D"(dp), "+S"(sp), "+c"(tail)
+        :
+        : "memory"
+    );
+    dp = d + words * 4 - 4;
+    sp = s + words * 4 - 4;
+    asm volatile (
+        "std\n"
+        "rep movsl\n"
+        "cld"
+        : "+D"(dp), "+S"(sp), "+c"(words)
+        :
+        : "memory"
+    );
+    return dst;
+}
+
+NOLIBCALL
+void *(memset)(void *dst, int c, size_t n)
+{
+    u8 *d = dst;
+    u32 pattern = (u8)c * 0x01010101u;
+    if (n < REP) {
+        for (; n >= 4; n -= 4, d += 4) {
+            __builtin_memcpy(d, &pattern, 4);
+        }
+        while (n--) {
+            *d++ = (u8)c;
+        }
+        return dst;
+    }
+
+    if (fastrep()) {
+        asm volatile (
+            "rep stosb"
+            : "+D"(d), "+c"(n)
+            : "a"(c)
+            : "memory"
+        );
+        return dst;
+    }
+
+    size_t head = -(uintptr_t)d & 3;
+    size_t words = (n - head) >> 2;
+    size_t tail = (n - head) & 3;
+    asm volatile (
+        "rep stosb\n"
+        "mov %k[words], %%ecx\n"
+        "rep stosl\n"
+        "mov %k[tail], %%ecx\n"
+        "rep stosb"
+        : "+D"(d), "+c"(head)
+        : "a"(pattern), [words]"r"(words), [tail]"r"(tail)
+        : "memory"
+    );
+    return dst;
+}
+
+NOLIBCALL
+int (memcmp)(const void *a, const void *b, size_t n)
+{
+    const u8 *p = a;
+    const u8 *q = b;
+
+    // Skip equal dwords. x86 loads them at any alignment.
+    while (n >= 4) {
+        u32 x, y;
+        __builtin_memcpy(&x, p, 4);
+        __builtin_memcpy(&y, q, 4);
+        if (x != y) {
+            break;
+        }
+        p += 4;
+        q += 4;
+        n -= 4;
+    }
+
+    // The first difference is within the next dword, if any.
+    for (; n; n--, p++, q++) {
+        if (*p != *q) {
+            return *p - *q;
+        }
+    }
+    return 0;
+}
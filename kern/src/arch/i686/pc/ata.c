@@ -0,0 +1,555 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/pc/ata.c
+ * ATA (IDE) disk driver with PCI bus master DMA
+ * ISA IRQ 14, 15
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "pc.h"
+
+#include "../../../kernel.h"
+#include "../../../buf.h"
+#include "../asm.h"
+
+// An IDE controller (e.g. the PIIX, as emulated by QEMU) has two channels of
+// up to two drives each. In compatibility mode, the channels are at the
+// legacy ISA ports and IRQs; in native mode, they are in BAR 0-3 and share
+// the PCI interrupt line. BAR 4 holds the bus master registers of both
+// channels, 8 bytes each.
+#define LEGACY_BASE0 0x01f0
+#define LEGACY_CTRL0 0x03f6
+#define LEGACY_BASE1 0x0170
+#define LEGACY_CTRL1 0x0376
+
+#define PROGIF_NATIVE0 0x01
+#define PROGIF_NATIVE1 0x04
+#define PROGIF_MASTER 0x80      // Controller can do bus master DMA.
+
+// Command block registers, relative to the channel base.
+#define REG_DATA 0
+#define REG_ERROR 1
+#define REG_COUNT 2
+#define REG_LBA0 3
+#define REG_LBA1 4
+#define REG_LBA2 5
+#define REG_DRIVE 6
+#define REG_STATUS 7        // Reading it acknowledges the interrupt.
+#define REG_COMMAND 7
+
+// Control block register. Reading it doesn't acknowledge the interrupt.
+#define REG_ALTSTATUS 0
+#define REG_CONTROL 0
+
+// Bus master registers, relative to the channel's bus master base.
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ 0x08        // Device to memory.
+
+#define BM_ST_ACTIVE 0x01
+#define BM_ST_ERROR 0x02
+#define BM_ST_IRQ 0x04
+
+#define ST_ERR 0x01
+#define ST_DRQ 0x08
+#define ST_DF 0x20
+#define ST_BSY 0x80
+
+#define DRIVE_LBA 0xe0          // LBA addressing, and bits which must be set.
+#define DRIVE_SLAVE 0x10
+
+#define CTRL_HOB 0x80           // Read back the high bytes of LBA48.
+
+#define CMD_READ_PIO 0x20
+#define CMD_READ_PIO_EXT 0x24
+#define CMD_READ_DMA 0xc8
+#define CMD_READ_DMA_EXT 0x25
+#define CMD_WRITE_PIO 0x30
+#define CMD_WRITE_PIO_EXT 0x34
+#define CMD_WRITE_DMA 0xca
+#define CMD_WRITE_DMA_EXT 0x35
+#define CMD_FLUSH 0xe7
+#define CMD_FLUSH_EXT 0xea
+#define CMD_IDENTIFY 0xec
+
+// IDENTIFY data (word offsets).
+#define ID_CAPS 49              // Bit 8: DMA.
+#define ID_SECTORS 60           // LBA28 sector count (2 words).
+#define ID_FEATURES 83          // Bit 10: LBA48.
+#define ID_SECTORS48 100        // LBA48 sector count (4 words).
+
+#define SECTOR 512
+
+// A DMA transfer is described by a table of physical regions. A region may
+// not cross a 64K boundary, nor may the table itself. Addresses are
+// physical, which are the same as ours as long as paging is off.
+typedef struct {
+    u32 addr;
+    u16 count;              // In bytes, 0 means 64K.
+    u16 flags;
+} prd;
+
+#define PRD_EOT 0x8000          // Last region of the table.
+
+// Segments per request. A segment of up to BUF_MAXSIZE bytes needs at most
+// two regions.
+#define MAXSEGS 8
+#define NPRD (MAXSEGS * 2)
+
+// Polls are bounded.
+#define TIMEOUT_POLLS 10000000
+
+// What the channel is doing.
+enum {
+    IDLE,
+    PIO,
+    DMA,
+    FLUSH,      // Flushing the drive's cache after a DMA write.
+};
+
+typedef struct {
+    u16 base;
+    u16 ctrl;
+    u16 bmbase;             // 0 if the controller can't do DMA.
+    u8 irq;
+    u8 selected;            // Drive register last written, 0 if unknown.
+    prd *prdt;
+
+    // The request in progress. Drives on a channel take turns, so a request
+    // to the other drive may have to wait (each drive has one in flight at
+    // most).
+    u8 state;
+    struct drive *drive;
+    blkreq *req;
+    struct drive *waitdrive;
+    blkreq *waitreq;
+} channel;
+
+typedef struct drive {
+    blkdev dev;
+    channel *ch;
+    u8 slave;
+    bool present;
+    bool lba48;
+    bool candma;
+    bool dma;
+    char name[4];
+} drive;
+
+static prd prdts[2][NPRD] ALIGNED(NPRD * sizeof(prd));
+static channel channels[2];
+static drive drives[4];
+
+// The status register must not be looked at until 400 ns after selecting a
+// drive or issuing a command. Each read of the alternate status register
+// takes about 100 ns.
+static void delay400(channel *ch)
+{
+    for (int i = 0; i < 4; i++) {
+        inb(ch->ctrl + REG_ALTSTATUS);
+    }
+}
+
+// Polls until the drive is no longer busy. Returns its status, 0xff if it
+// stays busy.
+static u8 waitbusy(channel *ch)
+{
+    for (u32 i = 0; i < TIMEOUT_POLLS; i++) {
+        u8 st = inb(ch->ctrl + REG_ALTSTATUS);
+        if (!(st & ST_BSY)) {
+            return st;
+        }
+    }
+    return 0xff;
+}
+
+static void begin(drive *d, blkreq *req);
+
+// Hands a finished request back to the block layer, after starting the one
+// waiting for the channel, if any.
+static void finish(channel *ch, bool ok)
+{
+    drive *d = ch->drive;
+    blkreq *req = ch->req;
+    ch->state = IDLE;
+    ch->req = 0;
+
+    if (!ok) {
+        printf("Error: ata: %s: %s error at sector %u, status %x, error %x\n",
+                d->name, req->write ? "write" : "read", req->sector,
+                inb(ch->ctrl + REG_ALTSTATUS), inb(ch->base + REG_ERROR));
+    }
+
+    if (ch->waitreq) {
+        blkreq *next = ch->waitreq;
+        ch->waitreq = 0;
+        begin(ch->waitdrive, next);
+    }
+    blk_done(&d->dev, req, ok);
+}
+
+static void interrupt(channel *ch)
+{
+    u8 bmstatus = 0;
+    if (ch->bmbase) {
+        bmstatus = inb(ch->bmbase + BM_STATUS);
+        outb(ch->bmbase + BM_STATUS, BM_ST_IRQ | BM_ST_ERROR);
+    }
+    u8 status = inb(ch->base + REG_STATUS);
+    bool ok = !(bmstatus & BM_ST_ERROR) && !(status & (ST_ERR | ST_DF));
+
+    switch (ch->state) {
+    case DMA:
+        outb(ch->bmbase + BM_COMMAND, 0);
+        if (ok && ch->req->write) {
+            // Writes may sit in the drive's cache until flushed, which
+            // interrupts again when done.
+            bool ext = ch->drive->lba48;
+            ch->state = FLUSH;
+            outb(ch->base + REG_COMMAND, ext ? CMD_FLUSH_EXT : CMD_FLUSH);
+            return;
+        }
+        finish(ch, ok);
+        break;
+    case FLUSH:
+        finish(ch, ok);
+        break;
+    default:
+        // PIO transfers poll, and IDENTIFY interrupts too.
+        break;
+    }
+}
+
+INTERRUPT
+static void ata_fired0(INTERRUPT_ARGS)
+{
+    interrupt(&channels[0]);
+    sendeoi(channels[0].irq);
+}
+
+INTERRUPT
+static void ata_fired1(INTERRUPT_ARGS)
+{
+    interrupt(&channels[1]);
+    sendeoi(channels[1].irq);
+}
+
+// In native mode, both channels share the PCI interrupt line.
+INTERRUPT
+static void ata_fired_shared(INTERRUPT_ARGS)
+{
+    for (int i = 0; i < 2; i++) {
+        channel *ch = &channels[i];
+        if (!ch->bmbase || (inb(ch->bmbase + BM_STATUS) & BM_ST_IRQ)) {
+            interrupt(ch);
+        }
+    }
+    sendeoi(channels[0].irq);
+}
+
+static void select(drive *d, u8 bits)
+{
+    channel *ch = d->ch;
+    u8 reg = DRIVE_LBA | (d->slave ? DRIVE_SLAVE : 0) | bits;
+    if (ch->selected != reg) {
+        outb(ch->base + REG_DRIVE, reg);
+        ch->selected = reg;
+        delay400(ch);
+    }
+}
+
+// Selects the drive and sets up the registers for a command on `count`
+// sectors at `lba`. Returns whether the extended (LBA48) command is needed.
+static bool setup(drive *d, u64 lba, u32 count)
+{
+    channel *ch = d->ch;
+    bool ext = lba + count > 0x0fffffff;
+    if (ext) {
+        select(d, 0);
+        waitbusy(ch);
+        // The high bytes go first, through the same registers.
+        outb(ch->base + REG_COUNT, (u8)(count >> 8));
+        outb(ch->base + REG_LBA0, (u8)(lba >> 24));
+        outb(ch->base + REG_LBA1, (u8)(lba >> 32));
+        outb(ch->base + REG_LBA2, (u8)(lba >> 40));
+    } else {
+        select(d, (u8)(lba >> 24) & 0x0f);
+        waitbusy(ch);
+    }
+    outb(ch->base + REG_COUNT, (u8)count);
+    outb(ch->base + REG_LBA0, (u8)lba);
+    outb(ch->base + REG_LBA1, (u8)(lba >> 8));
+    outb(ch->base + REG_LBA2, (u8)(lba >> 16));
+    return ext;
+}
+
+// Transfers `count` sectors by PIO, polling the drive for every sector.
+static bool pio(drive *d, u64 lba, u32 count, void *data, bool write)
+{
+    channel *ch = d->ch;
+    bool ext = setup(d, lba, count);
+    if (write) {
+        outb(ch->base + REG_COMMAND, ext ? CMD_WRITE_PIO_EXT : CMD_WRITE_PIO);
+    } else {
+        outb(ch->base + REG_COMMAND, ext ? CMD_READ_PIO_EXT : CMD_READ_PIO);
+    }
+    delay400(ch);
+
+    u16 *words = data;
+    for (u32 i = 0; i < count; i++) {
+        u8 st = waitbusy(ch);
+        if (st & (ST_ERR | ST_DF) || !(st & ST_DRQ)) {
+            return false;
+        }
+        if (write) {
+            outsw(ch->base + REG_DATA, &words[i * SECTOR / 2], SECTOR / 2);
+        } else {
+            insw(ch->base + REG_DATA, &words[i * SECTOR / 2], SECTOR / 2);
+        }
+    }
+
+    if (write) {
+        // Writes may sit in the drive's cache until flushed.
+        waitbusy(ch);
+        outb(ch->base + REG_COMMAND, ext ? CMD_FLUSH_EXT : CMD_FLUSH);
+        delay400(ch);
+    }
+    u8 st = waitbusy(ch);
+    return !(st & (ST_ERR | ST_DF));
+}
+
+// Fills the region table for the segments of `req`. Returns false if they
+// don't fit or aren't word aligned.
+static bool mkprdt(prd *prdt, blkreq *req)
+{
+    unsigned n = 0;
+    for (blkreq *seg = req; seg; seg = seg->mnext) {
+        u32 addr = (u32)seg->data;
+        u32 size = seg->count * SECTOR;
+        if (addr & 1) {
+            return false;
+        }
+        while (size) {
+            if (n == NPRD) {
+                return false;
+            }
+            u32 len = 0x10000 - (addr & 0xffff);
+            if (len > size) {
+                len = size;
+            }
+            prdt[n++] = (prd) {
+                .addr = addr,
+                .count = (u16)len,
+            };
+            addr += len;
+            size -= len;
+        }
+    }
+    prdt[n - 1].flags = PRD_EOT;
+    return true;
+}
+
+// Starts a bus master DMA transfer of the whole request. The drive
+// interrupts when it is done.
+static bool dma(drive *d, blkreq *req)
+{
+    channel *ch = d->ch;
+    if (!mkprdt(ch->prdt, req)) {
+        return false;
+    }
+
+    u8 dir = req->write ? 0 : BM_CMD_READ;
+    outl(ch->bmbase + BM_PRDT, (u32)ch->prdt);
+    outb(ch->bmbase + BM_COMMAND, dir);
+    outb(ch->bmbase + BM_STATUS, BM_ST_IRQ | BM_ST_ERROR);
+
+    ch->state = DMA;
+    bool ext = setup(d, req->sector, req->total);
+    if (req->write) {
+        outb(ch->base + REG_COMMAND, ext ? CMD_WRITE_DMA_EXT : CMD_WRITE_DMA);
+    } else {
+        outb(ch->base + REG_COMMAND, ext ? CMD_READ_DMA_EXT : CMD_READ_DMA);
+    }
+    outb(ch->bmbase + BM_COMMAND, dir | BM_CMD_START);
+    return true;
+}
+
+// Starts `req` on the channel, which must be idle. PIO transfers are done
+// right away.
+static void begin(drive *d, blkreq *req)
+{
+    channel *ch = d->ch;
+    ch->drive = d;
+    ch->req = req;
+    if (d->dma && dma(d, req)) {
+        return;
+    }
+
+    ch->state = PIO;
+    bool ok = true;
+    u32 sector = req->sector;
+    for (blkreq *seg = req; seg && ok; seg = seg->mnext) {
+        ok = pio(d, sector, seg->count, seg->data, req->write);
+        sector += seg->count;
+    }
+    finish(ch, ok);
+}
+
+static bool ata_start(blkdev *dev, blkreq *req)
+{
+    drive *d = dev->priv;
+    channel *ch = d->ch;
+    u32 flags = irqsave();
+    if (ch->req) {
+        ch->waitdrive = d;
+        ch->waitreq = req;
+    } else {
+        begin(d, req);
+    }
+    irqrestore(flags);
+    return true;
+}
+
+static void identify(drive *d)
+{
+    channel *ch = d->ch;
+    d->ch->selected = 0;
+    select(d, 0);
+    outb(ch->base + REG_COUNT, 0);
+    outb(ch->base + REG_LBA0, 0);
+    outb(ch->base + REG_LBA1, 0);
+    outb(ch->base + REG_LBA2, 0);
+    outb(ch->base + REG_COMMAND, CMD_IDENTIFY);
+    delay400(ch);
+
+    // A status of 0 means there's no drive, 0xff that there's no channel.
+    u8 st = inb(ch->ctrl + REG_ALTSTATUS);
+    if (st == 0 || st == 0xff) {
+        return;
+    }
+    st = waitbusy(ch);
+
+    // ATAPI and SATA drives abort IDENTIFY and leave a signature behind.
+    if (inb(ch->base + REG_LBA1) || inb(ch->base + REG_LBA2) ||
+            st & ST_ERR || !(st & ST_DRQ)) {
+        return;
+    }
+
+    static u16 id[256];
+    insw(ch->base + REG_DATA, id, 256);
+    inb(ch->base + REG_STATUS);
+
+    u64 sectors = id[ID_SECTORS] | (u32)id[ID_SECTORS + 1] << 16;
+    d->lba48 = id[ID_FEATURES] & (1 << 10);
+    if (d->lba48) {
+        sectors = id[ID_SECTORS48] | (u64)id[ID_SECTORS48 + 1] << 16 |
+                (u64)id[ID_SECTORS48 + 2] << 32;
+    }
+    if (sectors == 0) {
+        return;
+    }
+
+    // Block devices are addressed in bytes within 32 bits.
+    if (sectors > 0xffffffffu / SECTOR) {
+        printf("ata: %s: only using the first 4 GiB\n", d->name);
+        sectors = 0xffffffffu / SECTOR;
+    }
+
+    d->present = true;
+    d->candma = ch->bmbase && (id[ID_CAPS] & (1 << 8));
+    d->dma = d->candma;
+    d->dev = (blkdev) {
+        .name = d->name,
+        .size = (u32)sectors * SECTOR,
+        .start = ata_start,
+        .depth = 1,
+        .maxsegs = MAXSEGS,
+        .priv = d,
+    };
+    printf("ata: %s: %u sectors%s%s\n", d->name, (u32)sectors,
+            d->lba48 ? ", LBA48" : "", d->dma ? ", DMA" : "");
+}
+
+void ata_init(void)
+{
+    puts("ata_init\n");
+
+    pci_addr pa;
+    if (!pci_find(0x01, 0x01, &pa)) {
+        puts("ata: no IDE controller\n");
+        return;
+    }
+
+    u32 cls = pci_read(pa, PCI_CLASS);
+    u8 progif = (u8)(cls >> 8);
+    u8 line = (u8)pci_read(pa, PCI_INTERRUPT);
+    u16 bmbase = 0;
+    if (progif & PROGIF_MASTER) {
+        bmbase = pci_read(pa, PCI_BAR(4)) & 0xfffc;
+        u32 cmd = pci_read(pa, PCI_COMMAND);
+        pci_write(pa, PCI_COMMAND, cmd | PCI_CMD_IO | PCI_CMD_MASTER);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        channel *ch = &channels[i];
+        bool native = progif & (i == 0 ? PROGIF_NATIVE0 : PROGIF_NATIVE1);
+        if (native) {
+            ch->base = pci_read(pa, PCI_BAR(i * 2)) & 0xfffc;
+            ch->ctrl = (pci_read(pa, PCI_BAR(i * 2 + 1)) & 0xfffc) + 2;
+            ch->irq = line;
+        } else {
+            ch->base = i == 0 ? LEGACY_BASE0 : LEGACY_BASE1;
+            ch->ctrl = i == 0 ? LEGACY_CTRL0 : LEGACY_CTRL1;
+            ch->irq = i == 0 ? 14 : 15;
+        }
+        ch->bmbase = bmbase ? bmbase + i * 8 : 0;
+        ch->prdt = prdts[i];
+
+        // Enable interrupts from the drives.
+        outb(ch->ctrl + REG_CONTROL, 0);
+
+        for (int j = 0; j < 2; j++) {
+            drive *d = &drives[i * 2 + j];
+            d->ch = ch;
+            d->slave = j;
+            d->name[0] = 'h';
+            d->name[1] = 'd';
+            d->name[2] = 'a' + i * 2 + j;
+            identify(d);
+        }
+
+        if (ch->irq != 14 && ch->irq != 15) {
+            if (i == 1 && channels[0].irq == ch->irq) {
+                continue;
+            }
+            setirq(ch->irq, &ata_fired_shared);
+        } else {
+            setirq(ch->irq, i == 0 ? &ata_fired0 : &ata_fired1);
+        }
+    }
+
+    puts("ata_init done\n");
+}
+
+blkdev *ata_getdev(unsigned n)
+{
+    if (n >= 4 || !drives[n].present) {
+        return 0;
+    }
+    return &drives[n].dev;
+}
+
+bool ata_setdma(unsigned n, bool dma)
+{
+    if (n >= 4 || !drives[n].present || (dma && !drives[n].candma)) {
+        return false;
+    }
+    drives[n].dma = dma;
+    return true;
+}
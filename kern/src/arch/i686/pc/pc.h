@@ -12,9 +12,66 @@
 #define PC_H
 
 #include "../../../kernel.h"
+#include "../../../buf.h"
 
 void pic_init(u8 offset);
 
 void pit_init(void);
 
+typedef struct {
+    u32 sent;       // Bytes sent.
+    u32 batches;    // Times the transmitter was filled.
+    u32 irqs;       // Transmitter empty interrupts.
+    u32 dropped;    // Bytes dropped because the queue was full.
+} uart_stats;
+
+// Sets up COM1 at 115200 baud, 8N1, and sends what was queued before. Needs
+// the PIC set up.
+void uart_init(void);
+// Queues a byte for COM1. Never waits: if the queue is full, it is dropped.
+void uart_putc(char ch);
+// Starts sending queued output, unless the UART is already busy with it.
+void uart_start(void);
+void uart_getstats(uart_stats *stats);
+
+// Location of a PCI function.
+typedef struct {
+    u8 bus;
+    u8 dev;
+    u8 fn;
+} pci_addr;
+
+// PCI configuration registers (dword offsets).
+#define PCI_ID 0x00         // Vendor, device ID.
+#define PCI_COMMAND 0x04    // Command, status.
+#define PCI_CLASS 0x08      // Revision, prog IF, subclass, class.
+#define PCI_HEADER 0x0c     // Header type (bit 23: multi-function).
+#define PCI_BAR(n) (0x10 + (n) * 4)
+#define PCI_INTERRUPT 0x3c  // Interrupt line.
+
+// PCI command register bits.
+#define PCI_CMD_IO 0x0001
+#define PCI_CMD_MASTER 0x0004
+
+u32 pci_read(pci_addr pa, u8 offset);
+void pci_write(pci_addr pa, u8 offset, u32 data);
+// Finds the first function of the given class. Returns false if none.
+bool pci_find(u8 class, u8 subclass, pci_addr *pa);
+// Finds the first function with the given IDs. Returns false if none.
+bool pci_findid(u16 vendor, u16 device, pci_addr *pa);
+
+// Probes the IDE controller and its drives. Needs interrupts enabled.
+void ata_init(void);
+// Returns drive `n` (0 and 1: primary master and slave, 2 and 3: secondary
+// master and slave) as a block device, 0 if there is no such drive.
+blkdev *ata_getdev(unsigned n);
+// Switches drive `n` between bus master DMA and PIO transfers, e.g. to
+// compare them. Returns false if the drive can't do DMA.
+bool ata_setdma(unsigned n, bool dma);
+
+// Probes for a virtio block device. Needs interrupts enabled.
+void virtblk_init(void);
+// Returns the virtio disk as a block device, 0 if there is none.
+blkdev *virtblk_getdev(void);
+
 #endif
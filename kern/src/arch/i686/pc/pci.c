@@ -0,0 +1,84 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/pc/pci.c
+ * PCI configuration space access (configuration mechanism #1)
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "pc.h"
+
+#include "../../../kernel.h"
+#include "../asm.h"
+
+// IO Ports
+// A configuration register is accessed by writing its address to
+// PCI_CONFIG_ADDRESS, then reading or writing the dword at PCI_CONFIG_DATA.
+#define PCI_CONFIG_ADDRESS 0x0cf8
+#define PCI_CONFIG_DATA 0x0cfc
+
+#define CONFIG_ENABLE 0x80000000
+
+static u32 address(pci_addr pa, u8 offset)
+{
+    return CONFIG_ENABLE | (u32)pa.bus << 16 | (u32)pa.dev << 11 |
+            (u32)pa.fn << 8 | (offset & 0xfc);
+}
+
+u32 pci_read(pci_addr pa, u8 offset)
+{
+    outl(PCI_CONFIG_ADDRESS, address(pa, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write(pci_addr pa, u8 offset, u32 data)
+{
+    outl(PCI_CONFIG_ADDRESS, address(pa, offset));
+    outl(PCI_CONFIG_DATA, data);
+}
+
+// Finds the first function whose register at `offset`, masked by `mask`,
+// equals `value`.
+static bool scan(u8 offset, u32 mask, u32 value, pci_addr *pa)
+{
+    // Brute force over all buses and devices, which is fast enough to do
+    // once at boot.
+    for (unsigned bus = 0; bus < 256; bus++) {
+        for (unsigned dev = 0; dev < 32; dev++) {
+            for (unsigned fn = 0; fn < 8; fn++) {
+                pci_addr at = { .bus = bus, .dev = dev, .fn = fn };
+                u32 id = pci_read(at, PCI_ID);
+                if ((id & 0xffff) == 0xffff) {
+                    if (fn == 0) {
+                        break;  // No device.
+                    }
+                    continue;
+                }
+
+                if ((pci_read(at, offset) & mask) == value) {
+                    *pa = at;
+                    return true;
+                }
+
+                // Only multi-function devices have functions past 0.
+                if (fn == 0 && !(pci_read(at, PCI_HEADER) & 0x00800000)) {
+                    break;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool pci_find(u8 class, u8 subclass, pci_addr *pa)
+{
+    return scan(PCI_CLASS, 0xffff0000, (u32)class << 24 | (u32)subclass << 16,
+            pa);
+}
+
+bool pci_findid(u16 vendor, u16 device, pci_addr *pa)
+{
+    return scan(PCI_ID, 0xffffffff, (u32)device << 16 | vendor, pa);
+}
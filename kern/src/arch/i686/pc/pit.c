@@ -27,11 +27,16 @@
 // be optimized out.
 static volatile unsigned sleep_ms;
 
+// Counts up the milliseconds since pit_init().
+static volatile u32 ticks_ms;
+
 INTERRUPT
 static void pit_fired(INTERRUPT_ARGS)
 {
     // We set the timer frequency to 1000 Hz or 1 tick/ms.
     sleep_ms--;
+    ticks_ms++;
+    console_flush();
 
     sendeoi(0);
 }
@@ -61,3 +66,8 @@ void msleep(unsigned millis)
         hlt();
     }
 }
+
+u32 ticks(void)
+{
+    return ticks_ms;
+}
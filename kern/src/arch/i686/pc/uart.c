@@ -0,0 +1,172 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/pc/uart.c
+ * 16550 UART serial port (COM1)
+ * ISA IRQ 4
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "pc.h"
+
+#include "../../../kernel.h"
+#include "../asm.h"
+
+// IO Ports
+#define COM1 0x03f8
+
+// Registers, relative to the port base. With DLAB set in LCR, the first two
+// are the baud rate divisor instead.
+#define REG_DATA 0          // THR (write), RBR (read).
+#define REG_IER 1           // Interrupt enable.
+#define REG_IIR 2           // Interrupt identification (read).
+#define REG_FCR 2           // FIFO control (write).
+#define REG_LCR 3           // Line control.
+#define REG_MCR 4           // Modem control.
+#define REG_DLL 0
+#define REG_DLM 1
+
+#define IER_THRE 0x02       // Interrupt when the transmitter is empty.
+
+#define IIR_NONE 0x01       // No interrupt pending.
+#define IIR_ID 0x0e
+#define IIR_THRE 0x02
+#define IIR_FIFO 0xc0       // FIFOs enabled and working (16550A).
+
+#define FCR_ENABLE 0x01
+#define FCR_CLEAR 0x06      // Clear both FIFOs.
+#define FCR_TRIGGER14 0xc0
+
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+
+#define MCR_DTR 0x01
+#define MCR_RTS 0x02
+#define MCR_OUT1 0x04
+#define MCR_OUT2 0x08       // Connects the interrupt line on PCs.
+#define MCR_LOOP 0x10
+
+// 115200 baud, the highest rate.
+#define DIVISOR 1
+
+// A 16550A takes 16 bytes at once when its transmitter is empty; older
+// chips have no working FIFO and take one.
+#define FIFO_SIZE 16
+
+// Output waits in a ring for the UART. It has one producer, uart_putc(), and
+// one consumer, whoever sends: the interrupt handler while the UART is
+// sending, uart_start() once it has gone idle. Each side only writes its own
+// index, so neither needs to lock out the other. When the ring is full,
+// output is dropped rather than waited for.
+#define RING_SIZE 4096
+
+static char ring[RING_SIZE];
+static u32 head;            // Next free slot, written by the producer.
+static u32 tail;            // Next byte to send, written by the consumer.
+
+static int present = -1;    // Unknown until uart_init().
+static u32 fifo;
+
+// A transmitter empty interrupt is due, whose handler will send what is
+// queued. Otherwise the transmitter is empty and nothing will happen until
+// uart_start() is called.
+static volatile bool busy;
+
+static uart_stats stats;
+
+// Fills the transmitter with queued output.
+static void send(void)
+{
+    u32 t = tail;
+    u32 h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    if (t == h) {
+        busy = false;
+        return;
+    }
+
+    u32 n = 0;
+    for (; n < fifo && t != h; n++, t++) {
+        outb(COM1 + REG_DATA, ring[t % RING_SIZE]);
+    }
+    __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    stats.sent += n;
+    stats.batches++;
+    busy = true;
+}
+
+INTERRUPT
+static void uart_fired(INTERRUPT_ARGS)
+{
+    // Reading IIR acknowledges the interrupt. It may have been raised when
+    // it was enabled, and already have been cleared by sending.
+    u8 iir = inb(COM1 + REG_IIR);
+    if (!(iir & IIR_NONE) && (iir & IIR_ID) == IIR_THRE) {
+        stats.irqs++;
+        send();
+    }
+
+    sendeoi(4);
+}
+
+void uart_init(void)
+{
+    puts("uart_init\n");
+
+    outb(COM1 + REG_IER, 0);
+    outb(COM1 + REG_LCR, LCR_DLAB);
+    outb(COM1 + REG_DLL, (u8)DIVISOR);
+    outb(COM1 + REG_DLM, (u8)(DIVISOR >> 8));
+    outb(COM1 + REG_LCR, LCR_8N1);
+    outb(COM1 + REG_FCR, FCR_ENABLE | FCR_CLEAR | FCR_TRIGGER14);
+
+    // See whether there is a UART at all by sending a byte to ourselves.
+    outb(COM1 + REG_MCR, MCR_LOOP | MCR_OUT2 | MCR_OUT1 | MCR_RTS);
+    outb(COM1 + REG_DATA, 0xae);
+    if (inb(COM1 + REG_DATA) != 0xae) {
+        present = 0;
+        puts("uart_init: no COM1\n");
+        return;
+    }
+
+    fifo = (inb(COM1 + REG_IIR) & IIR_FIFO) == IIR_FIFO ? FIFO_SIZE : 1;
+    outb(COM1 + REG_MCR, MCR_OUT2 | MCR_OUT1 | MCR_RTS | MCR_DTR);
+    setirq(4, &uart_fired);
+    outb(COM1 + REG_IER, IER_THRE);
+    present = 1;
+
+    // Sends what was printed before.
+    puts("uart_init done\n");
+}
+
+void uart_putc(char ch)
+{
+    if (!present) {
+        return;
+    }
+
+    u32 h = head;
+    if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        stats.dropped++;
+        return;
+    }
+    ring[h % RING_SIZE] = ch;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+void uart_start(void)
+{
+    u32 flags = irqsave();
+    if (present == 1 && !busy) {
+        send();
+    }
+    irqrestore(flags);
+}
+
+void uart_getstats(uart_stats *out)
+{
+    u32 flags = irqsave();
+    *out = stats;
+    irqrestore(flags);
+}
@@ -0,0 +1,290 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * arch/i686/pc/virtblk.c
+ * virtio block device driver (legacy PCI interface)
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "pc.h"
+
+#include "../../../kernel.h"
+#include "../../../buf.h"
+#include "../asm.h"
+
+// A virtio device talks to the driver through virtqueues in memory: the
+// driver puts chains of buffer descriptors in the descriptor table and their
+// heads in the available ring, the device puts the heads of the chains it is
+// done with in the used ring and interrupts. A block request is a chain of a
+// header, the data segments and a status byte, so any number of requests can
+// be in flight at once, limited by the queue size.
+//
+// We use the legacy interface in I/O space (BAR 0), which QEMU's
+// virtio-blk-pci offers unless started with disable-legacy=on.
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_LEGACY 0x1001
+
+// Legacy registers, relative to BAR 0.
+#define REG_DEVFEATURES 0x00
+#define REG_DRVFEATURES 0x04
+#define REG_QUEUEPFN 0x08       // Physical address of the queue / 4096.
+#define REG_QUEUESIZE 0x0c
+#define REG_QUEUESEL 0x0e
+#define REG_QUEUENOTIFY 0x10
+#define REG_STATUS 0x12
+#define REG_ISR 0x13            // Reading it acknowledges the interrupt.
+#define REG_CONFIG 0x14         // Device config, without MSI-X.
+
+// Block device config.
+#define CFG_CAPACITY 0x00       // In sectors (8 bytes).
+
+#define ST_ACKNOWLEDGE 0x01
+#define ST_DRIVER 0x02
+#define ST_DRIVER_OK 0x04
+#define ST_FAILED 0x80
+
+#define ISR_QUEUE 0x01
+
+// Descriptor flags.
+#define DESC_NEXT 0x0001
+#define DESC_WRITE 0x0002       // Written by the device.
+
+#define USED_NO_NOTIFY 0x0001
+
+// Request types and status.
+#define REQ_IN 0
+#define REQ_OUT 1
+#define REQ_OK 0
+
+#define SECTOR 512
+
+// The device chooses the size of the queue. This is the largest one we
+// have memory for.
+#define QUEUE_MAX 256
+#define PAGE 4096
+
+// Segments per request.
+#define MAXSEGS 16
+
+typedef struct {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} desc;
+
+typedef struct {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+} avail;
+
+typedef struct {
+    u16 flags;
+    u16 idx;
+    struct {
+        u32 id;
+        u32 len;
+    } ring[];
+} used;
+
+typedef struct {
+    u32 type;
+    u32 _reserved;
+    u64 sector;
+} reqheader;
+
+// A request in flight. Requests are found by the index of the first
+// descriptor of their chain.
+typedef struct {
+    reqheader hdr;
+    volatile u8 status;
+    u16 ndesc;
+    blkreq *req;
+} request;
+
+// Memory of a legacy virtqueue: the descriptor table and available ring,
+// then, on the next page, the used ring.
+#define QUEUE_MEMSIZE(n) \
+    (((16 * (n) + 6 + 2 * (n) + PAGE - 1) & ~(PAGE - 1)) + \
+    ((6 + 8 * (n) + PAGE - 1) & ~(PAGE - 1)))
+
+static u8 queuemem[QUEUE_MEMSIZE(QUEUE_MAX)] ALIGNED(PAGE);
+
+static struct {
+    bool present;
+    u16 base;
+    u8 irq;
+    u16 size;
+    desc *desc;
+    volatile avail *avail;
+    volatile used *used;
+    u16 freehead;           // Chain of free descriptors.
+    u16 nfree;
+    u16 lastused;           // Used ring entries up to here are handled.
+    request reqs[QUEUE_MAX];
+    blkdev dev;
+} vb;
+
+// Returns a chain of descriptors to the free list.
+static void freechain(u16 head, u16 n)
+{
+    u16 last = head;
+    for (u16 i = 1; i < n; i++) {
+        last = vb.desc[last].next;
+    }
+    vb.desc[last].next = vb.freehead;
+    vb.freehead = head;
+    vb.nfree += n;
+}
+
+// Handles every request the device has completed since the last interrupt,
+// however many that are.
+INTERRUPT
+static void virtblk_fired(INTERRUPT_ARGS)
+{
+    if (inb(vb.base + REG_ISR) & ISR_QUEUE) {
+        while (vb.lastused != vb.used->idx) {
+            __sync_synchronize();
+            u16 head = (u16)vb.used->ring[vb.lastused % vb.size].id;
+            request *r = &vb.reqs[head];
+            freechain(head, r->ndesc);
+            vb.lastused++;
+            blk_done(&vb.dev, r->req, r->status == REQ_OK);
+        }
+    }
+    sendeoi(vb.irq);
+}
+
+// Puts a request (with the ones merged into it) on the queue, and returns
+// without waiting for it.
+static bool virtblk_start(UNUSED blkdev *dev, blkreq *req)
+{
+    if (req->nsegs > MAXSEGS) {
+        return false;
+    }
+
+    u32 flags = irqsave();
+    if (vb.nfree < req->nsegs + 2) {
+        // Can't happen, the block layer keeps the number of requests in
+        // flight within what fits.
+        irqrestore(flags);
+        return false;
+    }
+
+    u16 head = vb.freehead;
+    request *r = &vb.reqs[head];
+    r->hdr = (reqheader) {
+        .type = req->write ? REQ_OUT : REQ_IN,
+        .sector = req->sector,
+    };
+    r->status = 0xff;
+    r->ndesc = req->nsegs + 2;
+    r->req = req;
+
+    // Header, segments, status, taken off the free list in order.
+    u16 i = head;
+    vb.desc[i].addr = (u32)&r->hdr;
+    vb.desc[i].len = sizeof r->hdr;
+    vb.desc[i].flags = DESC_NEXT;
+    for (blkreq *seg = req; seg; seg = seg->mnext) {
+        i = vb.desc[i].next;
+        vb.desc[i].addr = (u32)seg->data;
+        vb.desc[i].len = seg->count * SECTOR;
+        vb.desc[i].flags = DESC_NEXT | (req->write ? 0 : DESC_WRITE);
+    }
+    i = vb.desc[i].next;
+    vb.desc[i].addr = (u32)&r->status;
+    vb.desc[i].len = 1;
+    vb.desc[i].flags = DESC_WRITE;
+    vb.freehead = vb.desc[i].next;
+    vb.nfree -= req->nsegs + 2;
+
+    // The device may look at the ring as soon as the index moves, so the
+    // entry has to be in memory first.
+    vb.avail->ring[vb.avail->idx % vb.size] = head;
+    __sync_synchronize();
+    vb.avail->idx++;
+    __sync_synchronize();
+    if (!(vb.used->flags & USED_NO_NOTIFY)) {
+        outw(vb.base + REG_QUEUENOTIFY, 0);
+    }
+
+    irqrestore(flags);
+    return true;
+}
+
+void virtblk_init(void)
+{
+    puts("virtblk_init\n");
+
+    pci_addr pa;
+    if (!pci_findid(VIRTIO_VENDOR, VIRTIO_BLK_LEGACY, &pa)) {
+        puts("virtblk: no device\n");
+        return;
+    }
+
+    u32 cmd = pci_read(pa, PCI_COMMAND);
+    pci_write(pa, PCI_COMMAND, cmd | PCI_CMD_IO | PCI_CMD_MASTER);
+    vb.base = pci_read(pa, PCI_BAR(0)) & 0xfffc;
+    vb.irq = (u8)pci_read(pa, PCI_INTERRUPT);
+
+    // Reset, then tell the device we know how to drive it. We need none of
+    // the optional features.
+    outb(vb.base + REG_STATUS, 0);
+    outb(vb.base + REG_STATUS, ST_ACKNOWLEDGE);
+    outb(vb.base + REG_STATUS, ST_ACKNOWLEDGE | ST_DRIVER);
+    outl(vb.base + REG_DRVFEATURES, 0);
+
+    outw(vb.base + REG_QUEUESEL, 0);
+    vb.size = inw(vb.base + REG_QUEUESIZE);
+    if (vb.size < MAXSEGS + 2 || vb.size > QUEUE_MAX) {
+        printf("Error: virtblk: unsupported queue size %u\n", vb.size);
+        outb(vb.base + REG_STATUS, ST_FAILED);
+        return;
+    }
+
+    // The ring memory is laid out for the actual size.
+    vb.desc = (desc*)queuemem;
+    vb.avail = (avail*)&queuemem[16 * vb.size];
+    vb.used = (used*)&queuemem[(16 * vb.size + 6 + 2 * vb.size + PAGE - 1) &
+            ~(PAGE - 1)];
+    for (u16 i = 0; i < vb.size; i++) {
+        vb.desc[i].next = i + 1;
+    }
+    vb.freehead = 0;
+    vb.nfree = vb.size;
+    outl(vb.base + REG_QUEUEPFN, (u32)queuemem / PAGE);
+
+    u64 sectors = inl(vb.base + REG_CONFIG + CFG_CAPACITY) |
+            (u64)inl(vb.base + REG_CONFIG + CFG_CAPACITY + 4) << 32;
+    // Block devices are addressed in bytes within 32 bits.
+    if (sectors > 0xffffffffu / SECTOR) {
+        puts("virtblk: only using the first 4 GiB\n");
+        sectors = 0xffffffffu / SECTOR;
+    }
+
+    // Every request in flight takes at most MAXSEGS + 2 descriptors.
+    vb.dev = (blkdev) {
+        .name = "vda",
+        .size = (u32)sectors * SECTOR,
+        .start = virtblk_start,
+        .depth = vb.size / (MAXSEGS + 2),
+        .maxsegs = MAXSEGS,
+    };
+    vb.present = true;
+
+    setirq(vb.irq, &virtblk_fired);
+    outb(vb.base + REG_STATUS, ST_ACKNOWLEDGE | ST_DRIVER | ST_DRIVER_OK);
+
+    printf("virtblk: vda: %u sectors, queue size %u\n", (u32)sectors,
+            vb.size);
+    puts("virtblk_init done\n");
+}
+
+blkdev *virtblk_getdev(void)
+{
+    return vb.present ? &vb.dev : 0;
+}
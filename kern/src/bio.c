@@ -12,6 +12,22 @@
 
 #include <stdarg.h>
 
+#include "bio.h"
+#include "mem.h"
+
+// Parses the decimal length following an `S` in a format string.
+static unsigned strlength(const char **fmt)
+{
+    unsigned length = 0;
+    char ch;
+    while ((ch = **fmt) >= '0' && ch <= '9') {
+        length *= 10;
+        length += ch - '0';
+        (*fmt)++;
+    }
+    return length;
+}
+
 // Formatted Read Binary, Little Endian.
 // `fmt` is a template string where every character describes an argument:
 //   `B`: 1 Byte, `u8`
@@ -20,6 +36,7 @@
 //   `Q`: 8 bytes (Quadword), `u64`
 //   `Sn`, where n is a number: string of length n bytes, `char*`
 // Varargs are the pointers to write to.
+// For structures that are read often, prefer a field table (see bio.h).
 void readble(const u8 *buf, const char *fmt, ...)
 {
     va_list ap;
@@ -29,39 +46,30 @@ void readble(const u8 *buf, const char *fmt, ...)
     while ((ch = *fmt++)) {
         switch (ch) {
             case 'B':
-                *va_arg(ap, u8*) = *buf++;
+                *va_arg(ap, u8*) = getle8(buf);
+                buf += 1;
                 break;
 
             case 'W':
-                *va_arg(ap, u16*) = buf[0] + ((u16)buf[1] << 8);
+                *va_arg(ap, u16*) = getle16(buf);
                 buf += 2;
                 break;
             
             case 'L':
-                *va_arg(ap, u32*) = buf[0] + ((u32)buf[1] << 8) +
-                        ((u32)buf[2] << 16) + ((u32)buf[3] << 24);
+                *va_arg(ap, u32*) = getle32(buf);
                 buf += 4;
                 break;
 
             case 'Q':
-                *va_arg(ap, u64*) = buf[0] + ((u64)buf[1] << 8) +
-                        ((u64)buf[2] << 16) + ((u64)buf[3] << 24) +
-                        ((u64)buf[4] << 32) + ((u64)buf[5] << 40) +
-                        ((u64)buf[6] << 48) + ((u64)buf[7] << 56);
+                *va_arg(ap, u64*) = getle64(buf);
                 buf += 8;
                 break;
 
             case 'S': {
-                unsigned length = 0;
-                while ((ch = *fmt) >= '0' && ch <= '9') {
-                    length *= 10;
-                    length += ch - '0';
-                    fmt++;
-                }
+                unsigned length = strlength(&fmt);
                 char *dest = va_arg(ap, char*);
-                for (unsigned i = 0; i < length; i++) {
-                    *dest++ = *buf++;
-                }
+                memcpy(dest, buf, length);
+                buf += length;
                 break;
             }
             
@@ -75,6 +83,9 @@ fail:
 }
 
 // Formatted Write Binary, Little Endian.
+// The exact mirror of `readble()`: takes the same format string and the same
+// pointers, but reads the values from them and writes them to `buf`, so
+// `writeble()` followed by `readble()` with the same arguments round trips.
 void writeble(u8 *buf, const char *fmt, ...)
 {
     va_list ap;
@@ -83,7 +94,36 @@ void writeble(u8 *buf, const char *fmt, ...)
     char ch;
     while ((ch = *fmt++)) {
         switch (ch) {
+            case 'B':
+                putle8(buf, *va_arg(ap, const u8*));
+                buf += 1;
+                break;
+
+            case 'W':
+                putle16(buf, *va_arg(ap, const u16*));
+                buf += 2;
+                break;
+
+            case 'L':
+                putle32(buf, *va_arg(ap, const u32*));
+                buf += 4;
+                break;
+
+            case 'Q':
+                putle64(buf, *va_arg(ap, const u64*));
+                buf += 8;
+                break;
 
+            case 'S': {
+                unsigned length = strlength(&fmt);
+                const char *src = va_arg(ap, const char*);
+                memcpy(buf, src, length);
+                buf += length;
+                break;
+            }
+
+            default:
+                goto fail;
         }
     }
     
@@ -0,0 +1,163 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * bio.h
+ * Binary I/O utility: compile-time field tables
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#ifndef BIO_H
+#define BIO_H
+
+#include <stddef.h>
+
+#include "kernel.h"
+
+// `readble()` parses its format string at runtime, which is fine for one-off
+// reads but adds a switch dispatch per field to every structure we decode.
+// For structures that are read often (superblocks, inodes, ...) we instead
+// describe the on-disk layout once as a field table and let the compiler
+// generate straight-line code for it.
+//
+// A field table is a macro taking another macro `F` and applying it to every
+// field of the structure in on-disk order, e.g. for a
+// `struct { u32 count; u16 flags; char name[10]; }`:
+//
+//   #define FOO_FIELDS(F) F(L, count) F(W, flags) F(S, name)
+//
+// The kinds are the same as for `readble()`: `B`, `W`, `L`, `Q` for 1, 2, 4
+// and 8 byte little endian integers and `S` for byte strings. The field may
+// also be an array of the given kind, e.g. `u32 blocks[12]`.
+//
+// The structure itself is the single source of truth for the layout: the
+// on-disk offset of every field is its `offsetof()` in the C structure. This
+// only works for structures that are declared in on-disk order without
+// padding, which `BIO_DECODER` checks at compile time by adding up the sizes
+// of all the fields in the table.
+
+// Little endian loads from an unaligned byte buffer.
+static inline u8 getle8(const u8 *buf)
+{
+    return buf[0];
+}
+
+static inline u16 getle16(const u8 *buf)
+{
+    return buf[0] + ((u16)buf[1] << 8);
+}
+
+static inline u32 getle32(const u8 *buf)
+{
+    return buf[0] + ((u32)buf[1] << 8) +
+            ((u32)buf[2] << 16) + ((u32)buf[3] << 24);
+}
+
+static inline u64 getle64(const u8 *buf)
+{
+    return getle32(buf) + ((u64)getle32(&buf[4]) << 32);
+}
+
+// Little endian stores to an unaligned byte buffer.
+static inline void putle8(u8 *buf, u8 val)
+{
+    buf[0] = val;
+}
+
+static inline void putle16(u8 *buf, u16 val)
+{
+    buf[0] = (u8)val;
+    buf[1] = (u8)(val >> 8);
+}
+
+static inline void putle32(u8 *buf, u32 val)
+{
+    buf[0] = (u8)val;
+    buf[1] = (u8)(val >> 8);
+    buf[2] = (u8)(val >> 16);
+    buf[3] = (u8)(val >> 24);
+}
+
+static inline void putle64(u8 *buf, u64 val)
+{
+    putle32(buf, (u32)val);
+    putle32(&buf[4], (u32)(val >> 32));
+}
+
+// Per-kind decoders and encoders. `size` is the size of the field in the
+// structure in bytes, so that arrays are handled the same as scalars. It is
+// always a compile time constant, so the loops are unrolled.
+#define BIO_KIND(kind, type, get, put) \
+    static inline void bio_get_##kind(void *dst, const u8 *src, size_t size) \
+    { \
+        for (size_t i = 0; i < size / sizeof(type); i++) { \
+            ((type*)dst)[i] = get(&src[i * sizeof(type)]); \
+        } \
+    } \
+    static inline void bio_put_##kind(u8 *dst, const void *src, size_t size) \
+    { \
+        for (size_t i = 0; i < size / sizeof(type); i++) { \
+            put(&dst[i * sizeof(type)], ((const type*)src)[i]); \
+        } \
+    }
+
+BIO_KIND(B, u8, getle8, putle8)
+BIO_KIND(W, u16, getle16, putle16)
+BIO_KIND(L, u32, getle32, putle32)
+BIO_KIND(Q, u64, getle64, putle64)
+BIO_KIND(S, u8, getle8, putle8)
+
+#define BIO_FIELD_SIZE(kind, field) + sizeof rec->field
+
+#define BIO_CHECK_FIELDS(type, FIELDS) \
+    _Static_assert(0 FIELDS(BIO_FIELD_SIZE) == sizeof *rec, \
+            #type " does not match its field table")
+
+#define BIO_DECODE_FIELD(kind, field) \
+    bio_get_##kind(&rec->field, &buf[offsetof(__typeof__(*rec), field)], \
+            sizeof rec->field);
+
+#define BIO_ENCODE_FIELD(kind, field) \
+    bio_put_##kind(&buf[offsetof(__typeof__(*rec), field)], &rec->field, \
+            sizeof rec->field);
+
+// Defines `static void name(type *rec, const u8 *buf)`, which decodes one
+// `type` from `buf` according to the field table `FIELDS`, and
+// `static void name_n(type *rec, const u8 *buf, size_t stride, size_t count)`,
+// which decodes `count` records spaced `stride` bytes apart in `buf`.
+#define BIO_DECODER(name, type, FIELDS) \
+    UNUSED static void name(type *rec, const u8 *buf) \
+    { \
+        BIO_CHECK_FIELDS(type, FIELDS); \
+        FIELDS(BIO_DECODE_FIELD) \
+    } \
+    UNUSED static void name##_n(type *rec, const u8 *buf, size_t stride, \
+            size_t count) \
+    { \
+        for (size_t i = 0; i < count; i++) { \
+            name(&rec[i], &buf[i * stride]); \
+        } \
+    }
+
+// Same as `BIO_DECODER`, the other way around: defines
+// `static void name(u8 *buf, const type *rec)` and
+// `static void name_n(u8 *buf, const type *rec, size_t stride, size_t count)`.
+// Bytes in `buf` not covered by the field table (e.g. the rest of an inode
+// whose on-disk size is larger than `type`) are left untouched, so whole
+// blocks of records can be encoded in place.
+#define BIO_ENCODER(name, type, FIELDS) \
+    UNUSED static void name(u8 *buf, const type *rec) \
+    { \
+        BIO_CHECK_FIELDS(type, FIELDS); \
+        FIELDS(BIO_ENCODE_FIELD) \
+    } \
+    UNUSED static void name##_n(u8 *buf, const type *rec, size_t stride, \
+            size_t count) \
+    { \
+        for (size_t i = 0; i < count; i++) { \
+            name(&buf[i * stride], &rec[i]); \
+        } \
+    }
+
+#endif
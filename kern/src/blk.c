@@ -0,0 +1,305 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * blk.c
+ * Block request queue and scheduler
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "buf.h"
+
+#include "kernel.h"
+
+// Requests wait in a queue per device until the driver has room for them.
+// Waiting requests are kept sorted by sector, and a request that continues
+// a waiting one in the same direction is merged into it, so the device sees
+// fewer, larger requests. The queue is served like an elevator going one
+// way: the next request is the first one at or past where the last one
+// ended, wrapping around to the start of the device. So that requests at the
+// far end of the device aren't starved, each direction also has a list in
+// order of submission, and a request past its deadline is started first.
+// Reads get a shorter deadline than writes, as someone is usually waiting
+// for them.
+#define READ_DEADLINE 500
+#define WRITE_DEADLINE 5000
+
+// The queue is changed both by submitters and by interrupt handlers, so it
+// is only touched with interrupts disabled.
+
+static unsigned bucket(u32 val)
+{
+    unsigned n = 0;
+    while (val && n < BLK_NHIST - 1) {
+        val >>= 1;
+        n++;
+    }
+    return n;
+}
+
+static bool expired(const blkreq *req, u32 now)
+{
+    return (s32)(now - req->deadline) >= 0;
+}
+
+static u32 queued(blkqueue *q)
+{
+    u32 n = 0;
+    for (blkreq *r = q->sorted; r; r = r->snext) {
+        n += r->nsegs;
+    }
+    return n;
+}
+
+static void sorted_insert(blkqueue *q, blkreq *req)
+{
+    blkreq *prev = 0;
+    blkreq *next = q->sorted;
+    while (next && next->sector <= req->sector) {
+        prev = next;
+        next = next->snext;
+    }
+    req->sprev = prev;
+    req->snext = next;
+    if (prev) {
+        prev->snext = req;
+    } else {
+        q->sorted = req;
+    }
+    if (next) {
+        next->sprev = req;
+    }
+}
+
+static void fifo_append(blkqueue *q, blkreq *req)
+{
+    int dir = req->write;
+    req->fprev = q->fifotail[dir];
+    req->fnext = 0;
+    if (q->fifotail[dir]) {
+        q->fifotail[dir]->fnext = req;
+    } else {
+        q->fifo[dir] = req;
+    }
+    q->fifotail[dir] = req;
+}
+
+static void unlink(blkqueue *q, blkreq *req)
+{
+    int dir = req->write;
+    if (req->sprev) {
+        req->sprev->snext = req->snext;
+    } else {
+        q->sorted = req->snext;
+    }
+    if (req->snext) {
+        req->snext->sprev = req->sprev;
+    }
+    if (req->fprev) {
+        req->fprev->fnext = req->fnext;
+    } else {
+        q->fifo[dir] = req->fnext;
+    }
+    if (req->fnext) {
+        req->fnext->fprev = req->fprev;
+    } else {
+        q->fifotail[dir] = req->fprev;
+    }
+}
+
+// Puts `req` in the place of `old` in both lists.
+static void replace(blkqueue *q, blkreq *old, blkreq *req)
+{
+    int dir = req->write;
+    req->sprev = old->sprev;
+    req->snext = old->snext;
+    req->fprev = old->fprev;
+    req->fnext = old->fnext;
+    if (req->sprev) {
+        req->sprev->snext = req;
+    } else {
+        q->sorted = req;
+    }
+    if (req->snext) {
+        req->snext->sprev = req;
+    }
+    if (req->fprev) {
+        req->fprev->fnext = req;
+    } else {
+        q->fifo[dir] = req;
+    }
+    if (req->fnext) {
+        req->fnext->fprev = req;
+    } else {
+        q->fifotail[dir] = req;
+    }
+}
+
+// Merges `req` into a waiting request it continues, or which continues it.
+static bool merge(blkdev *dev, blkreq *req)
+{
+    blkqueue *q = &dev->q;
+    for (blkreq *r = q->sorted; r; r = r->snext) {
+        if (r->write != req->write || r->nsegs >= dev->maxsegs) {
+            continue;
+        }
+
+        if (r->sector + r->total == req->sector) {
+            r->mlast->mnext = req;
+            r->mlast = req;
+            r->nsegs++;
+            r->total += req->count;
+            return true;
+        }
+        if (req->sector + req->count == r->sector) {
+            // `req` becomes the head of the chain, and takes over its place
+            // in the queue and its deadline.
+            replace(q, r, req);
+            req->mnext = r;
+            req->mlast = r->mlast;
+            req->nsegs = r->nsegs + 1;
+            req->total = r->total + req->count;
+            req->queued = r->queued;
+            req->deadline = r->deadline;
+            r->mlast = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Picks the next request to start.
+static blkreq *next(blkqueue *q)
+{
+    u32 now = ticks();
+    for (int dir = 0; dir < 2; dir++) {
+        if (q->fifo[dir] && expired(q->fifo[dir], now)) {
+            q->stats.expired++;
+            return q->fifo[dir];
+        }
+    }
+
+    for (blkreq *r = q->sorted; r; r = r->snext) {
+        if (r->sector >= q->pos) {
+            return r;
+        }
+    }
+    return q->sorted;
+}
+
+// Starts waiting requests while the driver has room for them. Drivers may
+// complete requests right away, from within start(), so this must not
+// recurse through blk_done().
+static void run(blkdev *dev)
+{
+    blkqueue *q = &dev->q;
+    if (q->running) {
+        return;
+    }
+
+    q->running = true;
+    while (q->sorted && q->inflight < dev->depth) {
+        blkreq *req = next(q);
+        unlink(q, req);
+        q->pos = req->sector + req->total;
+        q->inflight++;
+        q->stats.dispatched++;
+        if (!dev->start(dev, req)) {
+            blk_done(dev, req, false);
+        }
+    }
+    q->running = false;
+}
+
+void blk_submit(blkdev *dev, blkreq *req)
+{
+    u32 flags = irqsave();
+    blkqueue *q = &dev->q;
+    q->stats.submitted++;
+    q->stats.depth[bucket(queued(q) + q->inflight)]++;
+
+    req->queued = ticks();
+    req->deadline = req->queued +
+            (req->write ? WRITE_DEADLINE : READ_DEADLINE);
+    req->mnext = 0;
+    req->mlast = req;
+    req->nsegs = 1;
+    req->total = req->count;
+
+    if (merge(dev, req)) {
+        q->stats.merged++;
+    } else {
+        sorted_insert(q, req);
+        fifo_append(q, req);
+    }
+
+    run(dev);
+    irqrestore(flags);
+}
+
+void blk_done(blkdev *dev, blkreq *req, bool ok)
+{
+    u32 flags = irqsave();
+    blkqueue *q = &dev->q;
+    q->inflight--;
+    if (!ok) {
+        q->stats.errors++;
+    }
+
+    u32 now = ticks();
+    while (req) {
+        // The callback may reuse the request.
+        blkreq *mnext = req->mnext;
+        q->stats.latency[bucket(now - req->queued)]++;
+        req->done(req, ok);
+        req = mnext;
+    }
+
+    run(dev);
+    irqrestore(flags);
+}
+
+typedef struct {
+    volatile bool done;
+    bool ok;
+} waiter;
+
+static void wakeup(blkreq *req, bool ok)
+{
+    waiter *w = req->priv;
+    w->ok = ok;
+    w->done = true;
+}
+
+bool blk_rw(blkdev *dev, bool write, u32 blkno, u32 size, void *data)
+{
+    if (!dev->start) {
+        if (write) {
+            return dev->write && dev->write(dev, blkno, size, data);
+        }
+        return dev->read(dev, blkno, size, data);
+    }
+
+    waiter w = { 0 };
+    blkreq req = {
+        .write = write,
+        .sector = blkno * (size / 512),
+        .count = size / 512,
+        .data = data,
+        .done = wakeup,
+        .priv = &w,
+    };
+    blk_submit(dev, &req);
+    while (!w.done) {
+        idle();
+    }
+    return w.ok;
+}
+
+void blk_getstats(blkdev *dev, blk_stats *out)
+{
+    u32 flags = irqsave();
+    *out = dev->q.stats;
+    irqrestore(flags);
+}
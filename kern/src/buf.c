@@ -0,0 +1,362 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * buf.c
+ * Buffer cache
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "buf.h"
+
+#include "kernel.h"
+
+// Number of hash buckets. Must be a power of two.
+#define NHASH 64
+
+// The buffer table, in the manner of UNIX. Buffers are found through a hash
+// of (dev, blkno). Buffers nobody holds a reference to are kept on an LRU
+// list, with free buffers and the least recently released ones first, so a
+// miss reuses the head.
+static buffer table[NBUF];
+// Aligned so that no buffer crosses a 64K boundary, which DMA can't.
+static char pool[NBUF][BUF_MAXSIZE] ALIGNED(BUF_MAXSIZE);
+static buffer *hash[NHASH];
+static buffer lru = { .lprev = &lru, .lnext = &lru };
+static bool initialized;
+
+static buffer_stats stats;
+
+static unsigned hashof(blkdev *dev, u32 blkno)
+{
+    return (blkno ^ ((uintptr_t)dev >> 4)) & (NHASH - 1);
+}
+
+static void lru_remove(buffer *bp)
+{
+    bp->lprev->lnext = bp->lnext;
+    bp->lnext->lprev = bp->lprev;
+}
+
+static void lru_append(buffer *bp)
+{
+    bp->lprev = lru.lprev;
+    bp->lnext = &lru;
+    lru.lprev->lnext = bp;
+    lru.lprev = bp;
+}
+
+static void lru_prepend(buffer *bp)
+{
+    bp->lprev = &lru;
+    bp->lnext = lru.lnext;
+    lru.lnext->lprev = bp;
+    lru.lnext = bp;
+}
+
+static void hash_remove(buffer *bp)
+{
+    buffer **pp = &hash[hashof(bp->dev, bp->blkno)];
+    while (*pp != bp) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = bp->hnext;
+}
+
+static void init(void)
+{
+    for (unsigned i = 0; i < NBUF; i++) {
+        lru_append(&table[i]);
+    }
+    initialized = true;
+}
+
+// Whether the block lies within the device.
+static bool inrange(blkdev *dev, u32 blkno, u32 size)
+{
+    return (u64)blkno * size + size <= dev->size;
+}
+
+static buffer *find(blkdev *dev, u32 blkno, u32 size)
+{
+    for (buffer *bp = hash[hashof(dev, blkno)]; bp; bp = bp->hnext) {
+        if (bp->dev == dev && bp->blkno == blkno && bp->size == size) {
+            return bp;
+        }
+    }
+    return 0;
+}
+
+// Takes an unreferenced buffer off the LRU list and drops its contents.
+// Buffers still being read ahead are left alone, and so are buffers whose
+// delayed write fails: they stay dirty, so that the next bsync() tries again
+// and reports the error.
+static buffer *reclaim(void)
+{
+    buffer *bp = lru.lnext;
+    while (bp != &lru && ((bp->flags & B_BUSY) ||
+            (bp->dev && (bp->flags & B_DIRTY) && !bwrite(bp)))) {
+        bp = bp->lnext;
+    }
+    if (bp == &lru) {
+        printf("Error: buf: buffer table overflow\n");
+        return 0;
+    }
+
+    if (bp->dev) {
+        hash_remove(bp);
+        bp->dev = 0;
+        stats.evictions++;
+    }
+    return bp;
+}
+
+buffer *bget(blkdev *dev, u32 blkno, u32 size)
+{
+    if (!initialized) {
+        init();
+    }
+
+    if (!inrange(dev, blkno, size) ||
+            (!dev->mem && (size > BUF_MAXSIZE || size % 512))) {
+        printf("Error: buf: bad block %u (size %u) on %s\n", blkno, size,
+                dev->name);
+        return 0;
+    }
+
+    buffer *bp = find(dev, blkno, size);
+    if (bp) {
+        if (bp->refs++ == 0) {
+            lru_remove(bp);
+        }
+        stats.hits++;
+
+        // Wait for a read ahead of time to finish. If it failed, the buffer
+        // is left invalid and bread() tries again.
+        while (bp->flags & B_BUSY) {
+            idle();
+        }
+        return bp;
+    }
+
+    stats.misses++;
+    if (!(bp = reclaim())) {
+        return 0;
+    }
+
+    lru_remove(bp);
+    bp->dev = dev;
+    bp->blkno = blkno;
+    bp->size = size;
+    bp->refs = 1;
+    if (dev->mem) {
+        // Memory backed blocks need no copy: the buffer is the block.
+        bp->data = &dev->mem[blkno * size];
+        bp->flags = B_VALID;
+    } else {
+        bp->data = pool[bp - table];
+        bp->flags = 0;
+    }
+
+    unsigned h = hashof(dev, blkno);
+    bp->hnext = hash[h];
+    hash[h] = bp;
+    return bp;
+}
+
+buffer *bread(blkdev *dev, u32 blkno, u32 size)
+{
+    buffer *bp = bget(dev, blkno, size);
+    if (!bp || (bp->flags & B_VALID)) {
+        return bp;
+    }
+
+    stats.reads++;
+    if (!blk_rw(dev, false, blkno, size, bp->data)) {
+        printf("Error: buf: read error on %s, block %u\n", dev->name, blkno);
+        brelse(bp);
+        return 0;
+    }
+    bp->flags |= B_VALID;
+    return bp;
+}
+
+void brelse(buffer *bp)
+{
+    //assert(bp->refs > 0)
+    if (--bp->refs) {
+        return;
+    }
+
+    if (bp->flags & (B_VALID | B_BUSY)) {
+        lru_append(bp);
+    } else {
+        // Nothing worth keeping, reuse it first.
+        hash_remove(bp);
+        bp->dev = 0;
+        lru_prepend(bp);
+    }
+}
+
+void bdirty(buffer *bp)
+{
+    bp->flags |= B_VALID;
+    if (!bp->dev->mem) {
+        bp->flags |= B_DIRTY;
+    }
+}
+
+bool bwrite(buffer *bp)
+{
+    bp->flags |= B_VALID;
+    if (bp->dev->mem) {
+        return true;
+    }
+
+    stats.writes++;
+    if (!blk_rw(bp->dev, true, bp->blkno, bp->size, bp->data)) {
+        printf("Error: buf: write error on %s, block %u\n", bp->dev->name,
+                bp->blkno);
+        return false;
+    }
+    bp->flags &= ~B_DIRTY;
+    return true;
+}
+
+static void prefetched(blkreq *req, bool ok)
+{
+    buffer *bp = req->priv;
+    if (ok) {
+        bp->flags |= B_VALID;
+    }
+    bp->flags &= ~B_BUSY;
+}
+
+void bprefetch(blkdev *dev, u32 blkno, u32 size)
+{
+    if (dev->mem) {
+        if (inrange(dev, blkno, size)) {
+            __builtin_prefetch(&dev->mem[blkno * size]);
+        }
+        return;
+    }
+
+    if (initialized && find(dev, blkno, size)) {
+        return;
+    }
+    if (!dev->start) {
+        // Synchronous devices can only read the block into the cache ahead
+        // of time.
+        buffer *bp = bread(dev, blkno, size);
+        if (bp) {
+            brelse(bp);
+        }
+        return;
+    }
+
+    // Otherwise, the read is queued and the buffer left to fill in the
+    // background. It stays in the cache while busy.
+    buffer *bp = bget(dev, blkno, size);
+    if (!bp) {
+        return;
+    }
+    stats.reads++;
+    bp->flags |= B_BUSY;
+    bp->req = (blkreq) {
+        .sector = blkno * (size / 512),
+        .count = size / 512,
+        .data = bp->data,
+        .done = prefetched,
+        .priv = bp,
+    };
+    blk_submit(dev, &bp->req);
+    brelse(bp);
+}
+
+// Writes in flight from bsync(), and whether any of them failed.
+static volatile u32 writing;
+static volatile bool writefailed;
+
+static void written(blkreq *req, bool ok)
+{
+    buffer *bp = req->priv;
+    if (ok) {
+        bp->flags &= ~B_DIRTY;
+    } else {
+        writefailed = true;
+    }
+    bp->flags &= ~B_BUSY;
+    writing--;
+}
+
+bool bsync(blkdev *dev)
+{
+    // Writes to devices with a queue are all submitted before waiting for
+    // any of them, so that the queue merges writes of neighboring blocks.
+    // The buffers are busy until then.
+    bool ok = true;
+    writefailed = false;
+    for (unsigned i = 0; i < NBUF; i++) {
+        buffer *bp = &table[i];
+        if (!bp->dev || (dev && bp->dev != dev) || !(bp->flags & B_DIRTY)) {
+            continue;
+        }
+        if (!bp->dev->start) {
+            ok &= bwrite(bp);
+            continue;
+        }
+
+        stats.writes++;
+        bp->flags |= B_BUSY;
+        bp->req = (blkreq) {
+            .write = true,
+            .sector = bp->blkno * (bp->size / 512),
+            .count = bp->size / 512,
+            .data = bp->data,
+            .done = written,
+            .priv = bp,
+        };
+        // written() may run for an earlier write in the middle of a plain
+        // increment.
+        u32 flags = irqsave();
+        writing++;
+        irqrestore(flags);
+        blk_submit(bp->dev, &bp->req);
+    }
+
+    while (writing) {
+        idle();
+    }
+    if (writefailed) {
+        printf("Error: buf: write error on %s\n", dev ? dev->name : "sync");
+        ok = false;
+    }
+    return ok;
+}
+
+void binval(blkdev *dev)
+{
+    if (!initialized) {
+        return;
+    }
+
+    for (unsigned i = 0; i < NBUF; i++) {
+        buffer *bp = &table[i];
+        if (bp->dev == dev && bp->refs == 0 && !(bp->flags & B_BUSY)) {
+            // A buffer that can't be written stays, for bsync() to report.
+            if ((bp->flags & B_DIRTY) && !bwrite(bp)) {
+                continue;
+            }
+            hash_remove(bp);
+            bp->dev = 0;
+            lru_remove(bp);
+            lru_prepend(bp);
+        }
+    }
+}
+
+void bstats(buffer_stats *out)
+{
+    *out = stats;
+}
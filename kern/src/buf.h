@@ -0,0 +1,176 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * buf.h
+ * Block devices and the buffer cache
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#ifndef BUF_H
+#define BUF_H
+
+#include "kernel.h"
+
+struct blkdev;
+
+// An asynchronous block request (see blk.c).
+typedef struct blkreq {
+    bool write;
+    u32 sector;         // First sector (512 bytes) on the device.
+    u32 count;          // Number of sectors.
+    void *data;
+    // Called when the request is done, from the device's interrupt handler.
+    void (*done)(struct blkreq *req, bool ok);
+    void *priv;         // Caller's data.
+
+    // Requests merged into this one continue it on the device, each with its
+    // own memory, so drivers see one request of `nsegs` segments and
+    // `total` sectors. Only set on the first request of the chain.
+    struct blkreq *mnext;
+    struct blkreq *mlast;
+    u32 nsegs;
+    u32 total;
+
+    // Queue internals.
+    u32 queued;         // ticks() when submitted.
+    u32 deadline;       // ticks() by which it should be started.
+    struct blkreq *sprev;   // Queued requests by sector.
+    struct blkreq *snext;
+    struct blkreq *fprev;   // Queued requests of the same direction by age.
+    struct blkreq *fnext;
+} blkreq;
+
+// Number of histogram buckets. Bucket 0 counts 0, bucket n > 0 counts values
+// from 2^(n-1) to 2^n - 1, the last bucket everything larger.
+#define BLK_NHIST 12
+
+typedef struct {
+    u32 submitted;
+    u32 merged;         // Requests merged into a queued one.
+    u32 dispatched;     // Requests started on the device (after merging)...
+    u32 expired;        // ...of which were past their deadline.
+    u32 errors;
+    u32 depth[BLK_NHIST];   // Requests queued or in flight at submission.
+    u32 latency[BLK_NHIST]; // Milliseconds from submission to completion.
+} blk_stats;
+
+// Request queue of a device.
+typedef struct {
+    blkreq *sorted;
+    blkreq *fifo[2];    // Oldest request, by direction (0: read, 1: write).
+    blkreq *fifotail[2];
+    u32 inflight;
+    u32 pos;            // Sector after the last request started.
+    bool running;
+    blk_stats stats;
+} blkqueue;
+
+// A block device. Filesystems don't access devices directly, but through
+// the buffer cache below.
+typedef struct blkdev {
+    const char *name;
+    u32 size;           // Size of the device in bytes.
+
+    // Device memory, for devices whose whole contents are in memory (RAM
+    // disks). Buffers of such devices point straight into it, and their
+    // contents stay valid and in place for as long as the device exists.
+    char *mem;
+
+    // Read or write `size` bytes (a multiple of 512) at byte offset
+    // `blkno * size`, waiting for the device. Not needed if `mem` or
+    // `start` is set.
+    bool (*read)(struct blkdev *dev, u32 blkno, u32 size, void *data);
+    bool (*write)(struct blkdev *dev, u32 blkno, u32 size, const void *data);
+
+    // Starts a request and returns without waiting for it. The driver calls
+    // blk_done() when the request is done, normally from its interrupt
+    // handler. Returns false if the request can't be started. Devices which
+    // have this get their requests through the queue in blk.c, with up to
+    // `depth` requests of up to `maxsegs` segments in flight.
+    bool (*start)(struct blkdev *dev, blkreq *req);
+    u32 depth;
+    u32 maxsegs;
+    blkqueue q;
+
+    void *priv;         // Driver data.
+} blkdev;
+
+// Queues a request to `dev` and returns without waiting for it. Requests
+// are merged with queued requests they continue, and started in order of
+// their position on the device, unless one waits past its deadline.
+void blk_submit(blkdev *dev, blkreq *req);
+// Called by drivers when a started request is done.
+void blk_done(blkdev *dev, blkreq *req, bool ok);
+// Reads or writes `size` bytes at byte offset `blkno * size` and waits for
+// it, through the queue or the device's read and write.
+bool blk_rw(blkdev *dev, bool write, u32 blkno, u32 size, void *data);
+void blk_getstats(blkdev *dev, blk_stats *stats);
+
+// A buffer holds the contents of one block of a device.
+typedef struct buffer {
+    blkdev *dev;        // Device, 0 if the buffer is free.
+    u32 blkno;          // Block number, in units of `size`.
+    u32 size;
+    u32 refs;           // Number of bread() without matching brelse().
+    volatile u16 flags;
+    char *data;
+    blkreq req;         // For background reads and writes.
+
+    struct buffer *hnext;  // Next buffer in the same hash bucket.
+    struct buffer *lprev;  // LRU list of unreferenced buffers.
+    struct buffer *lnext;
+} buffer;
+
+// Buffer flags.
+#define B_VALID 0x0001  // `data` holds the contents of the block.
+#define B_DIRTY 0x0002  // `data` is newer than the block on the device.
+#define B_BUSY 0x0004   // Being read or written in the background.
+
+// Number of buffers. As in UNIX, this is a fixed table, so the cache uses at
+// most `NBUF * BUF_MAXSIZE` bytes of memory. Buffers of memory backed devices
+// use none, which is why their blocks may also be larger.
+#define NBUF 32
+#define BUF_MAXSIZE 4096
+
+typedef struct {
+    u32 hits;
+    u32 misses;
+    u32 evictions;  // Cached blocks dropped to make room for others.
+    u32 reads;      // Blocks read from devices.
+    u32 writes;     // Blocks written to devices.
+} buffer_stats;
+
+// Gets a referenced buffer for a block, reading it if it is not cached.
+// Returns 0 on a read error or if every buffer is referenced.
+buffer *bread(blkdev *dev, u32 blkno, u32 size);
+// Same as bread(), but doesn't read the block. For blocks that are about to
+// be overwritten completely; check `B_VALID` otherwise.
+buffer *bget(blkdev *dev, u32 blkno, u32 size);
+// Releases a reference obtained from bread() or bget().
+void brelse(buffer *bp);
+// Marks a buffer as modified. It is written back when it is reclaimed or on
+// bsync() (delayed write).
+void bdirty(buffer *bp);
+// Writes a buffer back now.
+bool bwrite(buffer *bp);
+// Starts bringing a block into the cache, if it isn't already.
+void bprefetch(blkdev *dev, u32 blkno, u32 size);
+// Writes back all modified buffers of `dev` (of all devices if 0).
+bool bsync(blkdev *dev);
+// Writes back and drops all unreferenced buffers of `dev`. Buffers that
+// can't be written back stay dirty in the cache.
+void binval(blkdev *dev);
+void bstats(buffer_stats *stats);
+
+// Sets up `dev` as a RAM disk of `size` bytes at `mem`.
+void ramdisk_init(blkdev *dev, const char *name, char *mem, u32 size);
+struct lz4_frame;
+// Sets up `dev` as a RAM disk of the contents of the LZ4 frame `f`, which
+// are decompressed to `mem` (with room for `cap` bytes) a frame block at a
+// time, when first accessed. The frame's blocks must be independent.
+bool lzdisk_init(blkdev *dev, const char *name, struct lz4_frame *f,
+        char *mem, u32 cap);
+
+#endif
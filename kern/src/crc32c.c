@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * crc32c.c
+ * CRC-32C (Castagnoli) checksums
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "crc32c.h"
+
+#include "kernel.h"
+#include "bio.h"
+
+// The polynomial, bit reversed (the CRC is computed least significant bit
+// first).
+#define POLY 0x82f63b78
+
+// Slicing-by-8: table[0] advances the CRC by one byte, and table[k] by one
+// byte followed by k zero bytes. XORing eight lookups then advances it by
+// eight bytes at once, without a dependency between the lookups. The tables
+// take 8K and are computed on first use.
+static u32 table[8][256];
+static bool ready;
+
+static void maketables(void)
+{
+    for (u32 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+        }
+        table[0][i] = crc;
+    }
+    for (u32 i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            u32 prev = table[k - 1][i];
+            table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+        }
+    }
+    ready = true;
+}
+
+u32 crc32c_sw(u32 crc, const void *data, u32 len)
+{
+    if (!ready) {
+        maketables();
+    }
+
+    const u8 *p = data;
+    for (; len >= 8; len -= 8, p += 8) {
+        u32 lo = getle32(p) ^ crc;
+        u32 hi = getle32(&p[4]);
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+                table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+                table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+                table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; len; len--, p++) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
@@ -0,0 +1,24 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * crc32c.h
+ * CRC-32C (Castagnoli) checksums
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include "kernel.h"
+
+// Continues `crc` over `len` bytes of `data`. There are no implicit
+// inversions, so checksums can be built up in pieces: the usual CRC-32C of a
+// buffer is ~crc32c(~0, buf, len). Uses the CPU's CRC instruction if it has
+// one (see arch/.../crc32c.c).
+u32 crc32c(u32 crc, const void *data, u32 len);
+// Portable implementation, 8 bytes per step through lookup tables.
+u32 crc32c_sw(u32 crc, const void *data, u32 len);
+
+#endif
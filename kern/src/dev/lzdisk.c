@@ -0,0 +1,129 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * dev/lzdisk.c
+ * RAM disk decompressed on demand from an LZ4 frame
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "../buf.h"
+
+#include "../kernel.h"
+#include "../lz4.h"
+#include "../mem.h"
+
+// The disk is the decompressed contents of an LZ4 frame of independent
+// blocks. Every frame block decompresses to the same size (except the last),
+// so we know where each one goes without decompressing anything, and
+// decompress a block only when part of it is first read or written. Unlike
+// a plain RAM disk, blocks are copied in and out of the buffer cache.
+#define MAXCHUNKS 1024
+
+typedef struct {
+    lz4_block blk;
+    bool ready;         // Decompressed.
+} chunk;
+
+static struct {
+    char *mem;
+    u32 chunksize;
+    u32 nchunks;
+    chunk chunks[MAXCHUNKS];
+} disk;
+
+static bool load(chunk *c)
+{
+    if (c->ready) {
+        return true;
+    }
+
+    u32 n = c - disk.chunks;
+    u8 *dst = (u8*)&disk.mem[n * disk.chunksize];
+    if (lz4_decode(&c->blk, dst, disk.chunksize, dst) < 0) {
+        printf("Error: lzdisk: corrupt block %u\n", n);
+        return false;
+    }
+    c->ready = true;
+    return true;
+}
+
+// Makes sure the chunks holding `size` bytes at `offset` are decompressed.
+static bool loadrange(u32 offset, u32 size)
+{
+    u32 last = (offset + size - 1) / disk.chunksize;
+    for (u32 n = offset / disk.chunksize; n <= last; n++) {
+        if (!load(&disk.chunks[n])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool lzdisk_read(UNUSED blkdev *dev, u32 blkno, u32 size, void *data)
+{
+    u32 offset = blkno * size;
+    if (!loadrange(offset, size)) {
+        return false;
+    }
+    memcpy(data, &disk.mem[offset], size);
+    return true;
+}
+
+static bool lzdisk_write(UNUSED blkdev *dev, u32 blkno, u32 size,
+        const void *data)
+{
+    u32 offset = blkno * size;
+    if (!loadrange(offset, size)) {
+        return false;
+    }
+    memcpy(&disk.mem[offset], data, size);
+    return true;
+}
+
+bool lzdisk_init(blkdev *dev, const char *name, lz4_frame *f, char *mem,
+        u32 cap)
+{
+    if (!f->independent) {
+        printf("Error: lzdisk: frame blocks are not independent\n");
+        return false;
+    }
+
+    disk.mem = mem;
+    disk.chunksize = f->blockmax;
+    disk.nchunks = 0;
+    lz4_block blk;
+    while (lz4_next(f, &blk)) {
+        if (disk.nchunks == MAXCHUNKS ||
+                (u64)(disk.nchunks + 1) * disk.chunksize > cap) {
+            printf("Error: lzdisk: image too large\n");
+            return false;
+        }
+        disk.chunks[disk.nchunks++] = (chunk) {
+            .blk = blk,
+        };
+    }
+    if (disk.nchunks == 0) {
+        return false;
+    }
+
+    // Only the last block can be short, and decompressing it tells by how
+    // much.
+    chunk *last = &disk.chunks[disk.nchunks - 1];
+    u8 *dst = (u8*)&mem[(disk.nchunks - 1) * disk.chunksize];
+    s32 lastsize = lz4_decode(&last->blk, dst, disk.chunksize, dst);
+    if (lastsize < 0) {
+        printf("Error: lzdisk: corrupt block %u\n", disk.nchunks - 1);
+        return false;
+    }
+    last->ready = true;
+
+    *dev = (blkdev) {
+        .name = name,
+        .size = (disk.nchunks - 1) * disk.chunksize + lastsize,
+        .read = lzdisk_read,
+        .write = lzdisk_write,
+    };
+    return true;
+}
@@ -0,0 +1,24 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * dev/ramdisk.c
+ * RAM disk block device
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "../buf.h"
+
+#include "../kernel.h"
+
+// A RAM disk is all device memory, so the buffer cache never needs to read or
+// write it: buffers point straight into it.
+void ramdisk_init(blkdev *dev, const char *name, char *mem, u32 size)
+{
+    *dev = (blkdev) {
+        .name = name,
+        .size = size,
+        .mem = mem,
+    };
+}
@@ -0,0 +1,423 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/alloc.c
+ * Block and inode allocation
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../bio.h"
+#include "../../kernel.h"
+
+// Every group has a bitmap block of its blocks and one of its inodes, with a
+// set bit for each one in use. Bitmaps are scanned 32 bits at a time, and the
+// first free bit of a word is found with a single bit scan. In core, each
+// group also keeps its free counts, so that full groups are skipped without
+// reading their bitmaps, and a hint below which it has nothing free, so that
+// the full start of a group isn't scanned again and again.
+//
+// Groups whose bitmaps were never initialized (ext4 uninit_bg and
+// metadata_csum) are not allocated from.
+//
+// Files and directories are given blocks at least as many at a time as the
+// superblock asks for (allocfiles and allocdirs), so that a file growing in
+// several steps still gets its blocks in a row. The blocks beyond the ones
+// needed are marked in use, and kept in core for the file's next blocks. As
+// nothing on disk owns them, they are freed again when the file is
+// truncated or written back, before the filesystem is marked clean.
+//
+// Only the bitmaps are changed here. The counts in the group descriptors and
+// the superblock are updated from the in-core ones on ext2_sync(), for all
+// the changes since the last one at once.
+
+// Allocation state of every group of all mounted filesystems.
+static ext2_group grppool[EXT2_BGDPOOL];
+static u32 grppoolused;
+
+static ext2_alloc_stats stats;
+
+// Shortest scan that goes through SSE2. Shorter ones don't make up for
+// switching the FPU on and off.
+#define SIMD_MINBITS 8192
+
+static bool usable(ext2fs *fs, u32 g, u16 uninit)
+{
+    return !(fs->bgdt[g].flags & uninit);
+}
+
+bool ext2_allocinit(ext2fs *fs)
+{
+    if (fs->numgroups > EXT2_BGDPOOL - grppoolused) {
+        printf("Error: ext2: Too many block groups (%u)\n", fs->numgroups);
+        return false;
+    }
+
+    fs->groups = &grppool[grppoolused];
+    grppoolused += fs->numgroups;
+    fs->freeblocks = 0;
+    fs->resvblocks = 0;
+    for (u32 g = 0; g < fs->numgroups; g++) {
+        fs->groups[g] = (ext2_group) {
+            .freeblocks = fs->bgdt[g].freeblocks,
+            .freeinodes = fs->bgdt[g].freeinodes,
+            .numdirs = fs->bgdt[g].numdirs,
+        };
+        if (usable(fs, g, EXT2_BG_BLOCK_UNINIT)) {
+            fs->freeblocks += fs->groups[g].freeblocks;
+        }
+    }
+    return true;
+}
+
+// Number of blocks in group `g`. The last group may be short.
+static u32 grpblocks(ext2fs *fs, u32 g)
+{
+    u32 first = fs->sblock.sblockno + g * fs->sblock.grpblocks;
+    u32 left = fs->sblock.numblocks - first;
+    return left < fs->sblock.grpblocks ? left : fs->sblock.grpblocks;
+}
+
+// Returns the first bit at or after `start` and below `end` that is clear
+// (`set` false) or set (`set` true), or `end` if there is none. Bitmaps fill
+// whole blocks, so whole words can be read past `end`. Long scans skip full
+// stretches 512 bits at a time with SSE2 first, if they can, as that is worth
+// switching the FPU on for.
+static u32 scan(const u8 *map, u32 start, u32 end, bool set)
+{
+    if (end - start >= SIMD_MINBITS && kernel_fpu_usable()) {
+        kernel_fpu_begin();
+        u32 skip = ext2_bitskip_simd(map, start, end, set);
+        kernel_fpu_end();
+        stats.words += (skip - (start & ~31)) / 32;
+        start = skip;
+    }
+
+    u32 flip = set ? 0 : ~0;
+    for (u32 i = start & ~31; i < end; i += 32) {
+        u32 word = getle32(&map[i / 8]) ^ flip;
+        stats.words++;
+        if (i < start) {
+            word &= ~0u << (start - i);
+        }
+        if (word) {
+            u32 bit = i + __builtin_ctz(word);
+            return bit < end ? bit : end;
+        }
+    }
+    return end;
+}
+
+static void setbits(u8 *map, u32 start, u32 len, bool set)
+{
+    for (u32 i = start; i < start + len; i++) {
+        if (set) {
+            map[i / 8] |= 1 << (i % 8);
+        } else {
+            map[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+static void takefree(ext2fs *fs, u32 n)
+{
+    fs->freeblocks -= n < fs->freeblocks ? n : fs->freeblocks;
+}
+
+// Allocates up to `want` free blocks in a row from group `g`, starting at the
+// first free one at or after bit `goal`, or failing that, the first free one
+// in the group. Returns the number allocated and their first bit in `*bit`.
+static u32 grpballoc(ext2fs *fs, u32 g, u32 goal, u32 want, u32 *bit)
+{
+    ext2_group *grp = &fs->groups[g];
+    u32 nbits = grpblocks(fs, g);
+    buffer *bp = ext2_bread(fs, fs->bgdt[g].blkbitmap);
+    if (!bp) {
+        return 0;
+    }
+
+    u8 *map = (u8*)bp->data;
+    if (goal < grp->blkhint) {
+        goal = grp->blkhint;
+    }
+    u32 start = scan(map, goal, nbits, false);
+    if (start == nbits && goal > grp->blkhint) {
+        start = scan(map, grp->blkhint, goal, false);
+        if (start == goal) {
+            start = nbits;
+        }
+    }
+    if (start == nbits) {
+        // The counts were wrong, or the bitmap is corrupt.
+        takefree(fs, grp->freeblocks);
+        grp->freeblocks = 0;
+        brelse(bp);
+        return 0;
+    }
+
+    u32 limit = nbits - start < want ? nbits : start + want;
+    u32 len = scan(map, start, limit, true) - start;
+    setbits(map, start, len, true);
+    bdirty(bp);
+    brelse(bp);
+
+    if (start == grp->blkhint) {
+        grp->blkhint = start + len;
+    }
+    u32 used = len < grp->freeblocks ? len : grp->freeblocks;
+    grp->freeblocks -= used;
+    takefree(fs, used);
+    grp->dirty = true;
+    *bit = start;
+    return len;
+}
+
+u32 ext2_balloc(ext2fs *fs, u32 goal, u32 want, u32 *got)
+{
+    // Reserved blocks are allocated once their reservation is given back.
+    u32 avail = fs->freeblocks > fs->resvblocks ?
+            fs->freeblocks - fs->resvblocks : 0;
+    *got = 0;
+    want = want < avail ? want : avail;
+    if (want == 0) {
+        return 0;
+    }
+
+    u32 first = fs->sblock.sblockno;
+    if (goal < first || goal >= fs->sblock.numblocks) {
+        goal = first;
+    }
+    u32 g = (goal - first) / fs->sblock.grpblocks;
+    u32 goalbit = (goal - first) % fs->sblock.grpblocks;
+
+    // The goal's group, then the ones following it.
+    for (u32 i = 0; i < fs->numgroups; i++) {
+        if (fs->groups[g].freeblocks && usable(fs, g, EXT2_BG_BLOCK_UNINIT)) {
+            u32 bit;
+            u32 n = grpballoc(fs, g, goalbit, want, &bit);
+            if (n) {
+                stats.blocks += n;
+                *got = n;
+                return first + g * fs->sblock.grpblocks + bit;
+            }
+        } else {
+            stats.skipped++;
+        }
+        g = g + 1 < fs->numgroups ? g + 1 : 0;
+        goalbit = 0;
+    }
+    return 0;
+}
+
+bool ext2_breserve(ext2fs *fs, u32 n)
+{
+    if (fs->freeblocks < fs->resvblocks ||
+            fs->freeblocks - fs->resvblocks < n) {
+        return false;
+    }
+    fs->resvblocks += n;
+    return true;
+}
+
+void ext2_bunreserve(ext2fs *fs, u32 n)
+{
+    fs->resvblocks -= n < fs->resvblocks ? n : fs->resvblocks;
+}
+
+u32 ext2_prealloc(ext2fs *fs, bool dir)
+{
+    u32 n = dir ? fs->sblock.allocdirs : fs->sblock.allocfiles;
+    return n ? n : 1;
+}
+
+u32 ext2_iballoc(ext2_incore *ip, u32 goal, u32 want, u32 *got)
+{
+    ext2fs *fs = ip->fs;
+    *got = 0;
+    if (want == 0) {
+        return 0;
+    }
+
+    // Blocks kept for the file are only used where they continue it.
+    if (ip->nprealloc && ip->prealloc != goal) {
+        ext2_idiscard(ip);
+    }
+    if (!ip->nprealloc) {
+        bool dir = (ip->inode.mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+        u32 min = ext2_prealloc(fs, dir);
+        u32 n;
+        u32 blk = ext2_balloc(fs, goal, want > min ? want : min, &n);
+        if (!blk) {
+            return 0;
+        }
+        ip->prealloc = blk;
+        ip->nprealloc = n;
+    }
+
+    u32 blk = ip->prealloc;
+    *got = want < ip->nprealloc ? want : ip->nprealloc;
+    ip->prealloc += *got;
+    ip->nprealloc -= *got;
+    return blk;
+}
+
+void ext2_idiscard(ext2_incore *ip)
+{
+    if (ip->nprealloc) {
+        ext2_bfree(ip->fs, ip->prealloc, ip->nprealloc);
+        stats.discarded += ip->nprealloc;
+        ip->nprealloc = 0;
+    }
+}
+
+void ext2_bfree(ext2fs *fs, u32 blk, u32 count)
+{
+    u32 first = fs->sblock.sblockno;
+    while (count) {
+        if (blk < first || blk >= fs->sblock.numblocks) {
+            printf("Error: ext2: Freeing bad block %u\n", blk);
+            return;
+        }
+
+        // The run may span groups.
+        u32 g = (blk - first) / fs->sblock.grpblocks;
+        u32 bit = (blk - first) % fs->sblock.grpblocks;
+        u32 n = grpblocks(fs, g) - bit;
+        n = n < count ? n : count;
+
+        buffer *bp = ext2_bread(fs, fs->bgdt[g].blkbitmap);
+        if (!bp) {
+            return;
+        }
+        setbits((u8*)bp->data, bit, n, false);
+        bdirty(bp);
+        brelse(bp);
+
+        ext2_group *grp = &fs->groups[g];
+        grp->freeblocks += n;
+        fs->freeblocks += n;
+        grp->dirty = true;
+        if (bit < grp->blkhint) {
+            grp->blkhint = bit;
+        }
+        stats.freed += n;
+        blk += n;
+        count -= n;
+    }
+}
+
+// Allocates an inode from group `g`. Returns its number or 0.
+static u32 grpialloc(ext2fs *fs, u32 g, bool dir)
+{
+    ext2_group *grp = &fs->groups[g];
+    u32 nbits = fs->sblock.grpinodes;
+    buffer *bp = ext2_bread(fs, fs->bgdt[g].inobitmap);
+    if (!bp) {
+        return 0;
+    }
+
+    u8 *map = (u8*)bp->data;
+    u32 bit = scan(map, grp->inohint, nbits, false);
+    if (bit == nbits) {
+        grp->freeinodes = 0;
+        brelse(bp);
+        return 0;
+    }
+    setbits(map, bit, 1, true);
+    bdirty(bp);
+    brelse(bp);
+
+    grp->inohint = bit + 1;
+    grp->freeinodes--;
+    grp->numdirs += dir;
+    grp->dirty = true;
+    stats.inodes++;
+    return g * nbits + bit + 1;
+}
+
+static bool hasinodes(ext2fs *fs, u32 g)
+{
+    return fs->groups[g].freeinodes && usable(fs, g, EXT2_BG_INODE_UNINIT);
+}
+
+u32 ext2_ialloc(ext2fs *fs, u32 parent, bool dir)
+{
+    u32 start = parent ? (parent - 1) / fs->sblock.grpinodes : 0;
+    if (start >= fs->numgroups) {
+        start = 0;
+    }
+
+    if (dir) {
+        // Spread directories out: among the groups with at least the
+        // average number of free inodes, the one with the most free blocks.
+        // Their files then go to the same group.
+        u32 total = 0;
+        for (u32 g = 0; g < fs->numgroups; g++) {
+            total += fs->groups[g].freeinodes;
+        }
+        u32 avg = total / fs->numgroups;
+        u32 best = fs->numgroups;
+        for (u32 i = 0, g = start; i < fs->numgroups; i++) {
+            if (hasinodes(fs, g) && fs->groups[g].freeinodes >= avg &&
+                    (best == fs->numgroups || fs->groups[g].freeblocks >
+                    fs->groups[best].freeblocks)) {
+                best = g;
+            }
+            g = g + 1 < fs->numgroups ? g + 1 : 0;
+        }
+        if (best < fs->numgroups) {
+            u32 ino = grpialloc(fs, best, dir);
+            if (ino) {
+                return ino;
+            }
+        }
+    }
+
+    // The parent's group, then the ones following it.
+    for (u32 i = 0, g = start; i < fs->numgroups; i++) {
+        if (hasinodes(fs, g)) {
+            u32 ino = grpialloc(fs, g, dir);
+            if (ino) {
+                return ino;
+            }
+        } else {
+            stats.skipped++;
+        }
+        g = g + 1 < fs->numgroups ? g + 1 : 0;
+    }
+    return 0;
+}
+
+void ext2_ifree(ext2fs *fs, u32 ino, bool dir)
+{
+    if (ino < fs->sblock.firstino || ino > fs->sblock.numinodes) {
+        printf("Error: ext2: Freeing bad inode %u\n", ino);
+        return;
+    }
+
+    u32 g = (ino - 1) / fs->sblock.grpinodes;
+    u32 bit = (ino - 1) % fs->sblock.grpinodes;
+    buffer *bp = ext2_bread(fs, fs->bgdt[g].inobitmap);
+    if (!bp) {
+        return;
+    }
+    setbits((u8*)bp->data, bit, 1, false);
+    bdirty(bp);
+    brelse(bp);
+
+    ext2_group *grp = &fs->groups[g];
+    grp->freeinodes++;
+    grp->numdirs -= dir && grp->numdirs;
+    grp->dirty = true;
+    if (bit < grp->inohint) {
+        grp->inohint = bit;
+    }
+}
+
+void ext2_allocstats(ext2_alloc_stats *out)
+{
+    *out = stats;
+}
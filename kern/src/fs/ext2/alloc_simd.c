@@ -0,0 +1,42 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/alloc_simd.c
+ * Bitmap scanning with SSE2
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../kernel.h"
+
+// Built with SSE2: only called in kernel_fpu_begin() regions (see alloc.c).
+
+typedef char v16qi __attribute__((vector_size(16)));
+
+static inline v16qi load(const u8 *p)
+{
+    v16qi v;
+    __builtin_memcpy(&v, p, sizeof v);
+    return v;
+}
+
+SIMD u32 ext2_bitskip_simd(const u8 *map, u32 start, u32 end, bool set)
+{
+    // Bits looked for are 1 when set, so the ones passed over are all 0 and
+    // vice versa. 512 bits are compared a byte at a time to a full byte of
+    // those, and skipped if all are equal.
+    v16qi fill = (v16qi) { 0 } + (char)(set ? 0 : -1);
+    u32 i = start & ~511;
+    for (; i + 512 <= end; i += 512) {
+        const u8 *p = &map[i / 8];
+        v16qi eq = (load(p) == fill) & (load(&p[16]) == fill) &
+                (load(&p[32]) == fill) & (load(&p[48]) == fill);
+        if (__builtin_ia32_pmovmskb128(eq) != 0xffff) {
+            break;
+        }
+    }
+    return i > start ? i : start;
+}
@@ -0,0 +1,119 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/csum.c
+ * Metadata checksums
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../bio.h"
+#include "../../crc32c.h"
+#include "../../kernel.h"
+
+// With the ext4 metadata_csum feature, metadata carries a CRC-32C. Except for
+// the superblock's own, the checksums start from a per-filesystem seed (the
+// CRC of the UUID) and cover the number of the object, so that a structure
+// written to the wrong place is caught too. The checksum field itself counts
+// as zero. CRCs are continued without inversions, as crc32c() does.
+
+// Offsets in a raw inode. The checksum is split in two: the low half in
+// the OS specific area of the original 128 byte inode, the high half in the
+// extra space of larger inodes, if they have room for it.
+#define INO_LINKS 0x1a
+#define INO_GENERATION 0x64
+#define INO_CSUM_LO 0x7c
+#define INO_EXTRA_SIZE 0x80
+#define INO_CSUM_HI 0x82
+#define INO_OLD_SIZE 128
+
+static const u8 zero[2];
+
+static u32 crcnum(u32 crc, u32 num)
+{
+    u8 buf[4];
+    putle32(buf, num);
+    return crc32c(crc, buf, sizeof buf);
+}
+
+bool ext2_csuminit(ext2fs *fs, const u8 *raw)
+{
+    const ext2_sblock *sb = &fs->sblock;
+    fs->csum = false;
+    if (!(sb->rwreqfeatures & EXT2_FEATURE_METADATA_CSUM)) {
+        return true;
+    }
+
+    if (sb->csumtype != EXT2_CSUM_CRC32C) {
+        printf("Error: ext2: Unknown checksum type %u\n", sb->csumtype);
+        return false;
+    }
+    if (crc32c(~0, raw, offsetof(ext2_sblock, csum)) != sb->csum) {
+        printf("Error: ext2: Superblock checksum mismatch\n");
+        return false;
+    }
+
+    if (sb->reqfeatures & EXT2_FEATURE_CSUM_SEED) {
+        fs->csumseed = sb->csumseed;
+    } else {
+        fs->csumseed = crc32c(~0, &raw[offsetof(ext2_sblock, fsid)],
+                sizeof sb->fsid);
+    }
+    fs->csum = true;
+    return true;
+}
+
+bool ext2_bgdok(ext2fs *fs, u32 group, const u8 *raw)
+{
+    if (!fs->csum) {
+        return true;
+    }
+
+    // Only the low 16 bits are stored. The checksum is the last field of
+    // our 32 byte descriptors, and covers the rest of larger ones too.
+    u32 crc = crcnum(fs->csumseed, group);
+    crc = crc32c(crc, raw, offsetof(ext2_bgd, csum));
+    crc = crc32c(crc, zero, sizeof zero);
+    crc = crc32c(crc, &raw[sizeof(ext2_bgd)], fs->descsize - sizeof(ext2_bgd));
+    if ((crc & 0xffff) != getle16(&raw[offsetof(ext2_bgd, csum)])) {
+        printf("Error: ext2: Group %u descriptor checksum mismatch\n", group);
+        return false;
+    }
+    return true;
+}
+
+bool ext2_inodeok(ext2fs *fs, u32 ino, const u8 *raw)
+{
+    // Free inodes are not checked: inode tables start out zeroed, without
+    // valid checksums.
+    if (!fs->csum || getle16(&raw[INO_LINKS]) == 0) {
+        return true;
+    }
+
+    u32 size = 1 << fs->inoshift;
+    u32 crc = crcnum(fs->csumseed, ino);
+    crc = crc32c(crc, &raw[INO_GENERATION], 4);
+    crc = crc32c(crc, raw, INO_CSUM_LO);
+    crc = crc32c(crc, zero, sizeof zero);
+    u32 want = getle16(&raw[INO_CSUM_LO]);
+
+    if (size > INO_OLD_SIZE && INO_OLD_SIZE + getle16(&raw[INO_EXTRA_SIZE]) >=
+            INO_CSUM_HI + 2) {
+        crc = crc32c(crc, &raw[INO_CSUM_LO + 2], INO_CSUM_HI - INO_CSUM_LO - 2);
+        crc = crc32c(crc, zero, sizeof zero);
+        crc = crc32c(crc, &raw[INO_CSUM_HI + 2], size - INO_CSUM_HI - 2);
+        want |= (u32)getle16(&raw[INO_CSUM_HI]) << 16;
+    } else {
+        crc = crc32c(crc, &raw[INO_CSUM_LO + 2], size - INO_CSUM_LO - 2);
+        crc &= 0xffff;
+    }
+
+    if (crc != want) {
+        printf("Error: ext2: Inode %u checksum mismatch\n", ino);
+        return false;
+    }
+    return true;
+}
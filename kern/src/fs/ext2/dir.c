@@ -0,0 +1,278 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/dir.c
+ * Reading and changing directories
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../bio.h"
+#include "../../kernel.h"
+#include "../../mem.h"
+
+// Maps the block `lblk` the cursor is in, and looks ahead to the next one.
+static u32 mapblock(ext2_incore *dir, ext2_dircursor *cur, u32 lblk)
+{
+    if (cur->mapped == lblk + 1) {
+        return cur->pblk;
+    }
+
+    ext2fs *fs = dir->fs;
+    if (lblk != 0 && cur->mapped == lblk) {
+        // Moving on to the block we looked ahead to.
+        cur->pblk = cur->nextpblk;
+    } else {
+        cur->pblk = ext2_ibmap(dir, lblk);
+    }
+    cur->mapped = lblk + 1;
+
+    // Start fetching the next block while the caller is busy with the
+    // entries of this one.
+    u32 nblocks = (dir->inode.size_lo + fs->blksize - 1) >> fs->blkshift;
+    cur->nextpblk = lblk + 1 < nblocks ? ext2_ibmap(dir, lblk + 1) : 0;
+    if (cur->nextpblk) {
+        bprefetch(fs->dev, cur->nextpblk, fs->blksize);
+    }
+
+    return cur->pblk;
+}
+
+int ext2_readdir(ext2_incore *dir, ext2_dircursor *cur, void *buf, u32 size)
+{
+    ext2fs *fs = dir->fs;
+    union {
+        ext2_dir_entry e;
+        char raw[sizeof(ext2_dir_entry) + EXT2_NAME_MAX];
+    } tmp;
+
+    if ((dir->inode.mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return -1;
+    }
+
+    // The block the cursor is in stays referenced while we are in it.
+    buffer *bp = 0;
+    char *out = buf;
+    u32 done = 0;
+    while (cur->offset < dir->inode.size_lo) {
+        u32 lblk = cur->offset >> fs->blkshift;
+        u32 inblk = cur->offset & (fs->blksize - 1);
+        u32 pblk = mapblock(dir, cur, lblk);
+        if (pblk == 0 || inblk + sizeof(ext2_dir_entry) > fs->blksize) {
+            // Holes in directories have no entries.
+            cur->offset = (lblk + 1) << fs->blkshift;
+            continue;
+        }
+
+        if (bp && bp->blkno != pblk) {
+            brelse(bp);
+            bp = 0;
+        }
+        if (!bp && !(bp = ext2_bread(fs, pblk))) {
+            cur->offset = (lblk + 1) << fs->blkshift;
+            continue;
+        }
+
+        const char *raw = &bp->data[inblk];
+        const ext2_dir_entry *ep = ext2_getdirent(fs, &tmp.e, raw,
+                fs->blksize - inblk);
+        if (!ep || ep->reclen < sizeof(ext2_dir_entry) + ep->namelen ||
+                ep->reclen > fs->blksize - inblk) {
+            printf("Error: ext2: Bad directory entry in inode %u\n",
+                    dir->ino);
+            cur->offset = (lblk + 1) << fs->blkshift;
+            continue;
+        }
+
+        if (ep->ino) {
+            u32 reclen = (sizeof(ext2_dir_entry) + ep->namelen + 1 + 3) & ~3;
+            if (reclen > size - done) {
+                brelse(bp);
+                return done ? (int)done : -1;
+            }
+
+            ext2_dir_entry *dp = (ext2_dir_entry*)&out[done];
+            dp->ino = ep->ino;
+            dp->reclen = reclen;
+            dp->namelen = ep->namelen;
+            dp->type = ep->type;
+            memcpy(dp->name, ep->name, ep->namelen);
+            dp->name[ep->namelen] = 0;
+            done += reclen;
+        }
+
+        cur->offset += ep->reclen;
+    }
+
+    if (bp) {
+        brelse(bp);
+    }
+    return done;
+}
+
+// Size of an entry with a name of `len` bytes, without room to spare.
+static u32 entsize(u32 len)
+{
+    return (sizeof(ext2_dir_entry) + len + 3) & ~3;
+}
+
+static void putentry(u8 *raw, u32 ino, u32 reclen, const char *name, u32 len,
+        u8 type)
+{
+    putle32(&raw[offsetof(ext2_dir_entry, ino)], ino);
+    putle16(&raw[offsetof(ext2_dir_entry, reclen)], reclen);
+    raw[offsetof(ext2_dir_entry, namelen)] = len;
+    raw[offsetof(ext2_dir_entry, type)] = type;
+    memcpy(&raw[sizeof(ext2_dir_entry)], name, len);
+}
+
+static u8 filetype(ext2fs *fs, u16 mode)
+{
+    if (!(fs->sblock.reqfeatures & EXT2_FEATURE_FILETYPE)) {
+        return 0;   // Without the feature, this is part of the name length.
+    }
+    switch (mode & EXT2_S_IFMT) {
+    case EXT2_S_IFDIR:
+        return EXT2_FT_DIR;
+    case EXT2_S_IFLNK:
+        return EXT2_FT_SYMLINK;
+    default:
+        return EXT2_FT_REG_FILE;
+    }
+}
+
+// Puts an entry into the room left after the entry at `raw`, or in its place
+// if it is unused. Returns false if there isn't enough room.
+static bool fitentry(u8 *raw, u32 need, const char *name, u32 len, u32 ino,
+        u8 type)
+{
+    u32 reclen = getle16(&raw[offsetof(ext2_dir_entry, reclen)]);
+    u32 used = getle32(&raw[offsetof(ext2_dir_entry, ino)]) ?
+            entsize(raw[offsetof(ext2_dir_entry, namelen)]) : 0;
+    if (used > reclen || reclen - used < need) {
+        return false;
+    }
+    if (used) {
+        putle16(&raw[offsetof(ext2_dir_entry, reclen)], used);
+    }
+    putentry(&raw[used], ino, reclen - used, name, len, type);
+    return true;
+}
+
+bool ext2_diradd(ext2_incore *dir, const char *name, u32 len, u32 ino,
+        u16 mode)
+{
+    ext2fs *fs = dir->fs;
+    u32 need = entsize(len);
+    u8 type = filetype(fs, mode);
+
+    // The index would have to be updated too. Like kernels that don't know
+    // about indexes, we rather drop it: the directory is still a valid one
+    // to scan, and fsck may rebuild the index.
+    if (dir->inode.flags & EXT2_INDEX_FL) {
+        dir->inode.flags &= ~EXT2_INDEX_FL;
+        ext2_idirty(dir);
+    }
+
+    u32 nblocks = dir->inode.size_lo >> fs->blkshift;
+    for (u32 lblk = 0; lblk < nblocks; lblk++) {
+        u32 pblk = ext2_ibmap(dir, lblk);
+        buffer *bp = pblk ? ext2_bread(fs, pblk) : 0;
+        if (!bp) {
+            continue;
+        }
+
+        u8 *block = (u8*)bp->data;
+        for (u32 off = 0; off + sizeof(ext2_dir_entry) <= fs->blksize; ) {
+            u32 reclen = getle16(&block[off +
+                    offsetof(ext2_dir_entry, reclen)]);
+            if (reclen < sizeof(ext2_dir_entry) || reclen > fs->blksize - off) {
+                printf("Error: ext2: Bad directory entry in inode %u\n",
+                        dir->ino);
+                break;
+            }
+            if (fitentry(&block[off], need, name, len, ino, type)) {
+                bdirty(bp);
+                brelse(bp);
+                return true;
+            }
+            off += reclen;
+        }
+        brelse(bp);
+    }
+
+    // No room anywhere: add a block after the last one.
+    u32 goal = nblocks ? ext2_ibmap(dir, nblocks - 1) + 1 : 0;
+    u32 got;
+    u32 pblk = ext2_iballoc(dir, goal, 1, &got);
+    if (!pblk) {
+        printf("Error: ext2: No free blocks\n");
+        return false;
+    }
+    goal = pblk + 1;
+    buffer *bp = bget(fs->dev, pblk, fs->blksize);
+    if (!bp || !ext2_setmap(dir, nblocks, pblk, &goal)) {
+        if (bp) {
+            brelse(bp);
+        }
+        ext2_bfree(fs, pblk, 1);
+        return false;
+    }
+    memset(bp->data, 0, fs->blksize);
+    putentry((u8*)bp->data, ino, fs->blksize, name, len, type);
+    bdirty(bp);
+    brelse(bp);
+
+    dir->inode.size_lo += fs->blksize;
+    dir->inode.sectors += fs->blksize / 512;
+    ext2_idirty(dir);
+    return true;
+}
+
+u32 ext2_dirremove(ext2_incore *dir, const char *name, u32 len)
+{
+    ext2fs *fs = dir->fs;
+    u32 nblocks = dir->inode.size_lo >> fs->blkshift;
+    for (u32 lblk = 0; lblk < nblocks; lblk++) {
+        u32 pblk = ext2_ibmap(dir, lblk);
+        buffer *bp = pblk ? ext2_bread(fs, pblk) : 0;
+        if (!bp) {
+            continue;
+        }
+
+        u8 *block = (u8*)bp->data;
+        u8 *prev = 0;
+        for (u32 off = 0; off + sizeof(ext2_dir_entry) <= fs->blksize; ) {
+            u8 *raw = &block[off];
+            u32 ino = getle32(&raw[offsetof(ext2_dir_entry, ino)]);
+            u32 reclen = getle16(&raw[offsetof(ext2_dir_entry, reclen)]);
+            if (reclen < sizeof(ext2_dir_entry) || reclen > fs->blksize - off) {
+                printf("Error: ext2: Bad directory entry in inode %u\n",
+                        dir->ino);
+                break;
+            }
+
+            if (ino && raw[offsetof(ext2_dir_entry, namelen)] == len &&
+                    !memcmp(&raw[sizeof(ext2_dir_entry)], name, len)) {
+                // The entry before takes over its room. The first entry of
+                // a block has none before it, and is only marked unused.
+                if (prev) {
+                    u8 *prevlen = &prev[offsetof(ext2_dir_entry, reclen)];
+                    putle16(prevlen, getle16(prevlen) + reclen);
+                } else {
+                    putle32(&raw[offsetof(ext2_dir_entry, ino)], 0);
+                }
+                bdirty(bp);
+                brelse(bp);
+                return ino;
+            }
+            prev = raw;
+            off += reclen;
+        }
+        brelse(bp);
+    }
+    return 0;
+}
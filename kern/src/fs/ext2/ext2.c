@@ -10,63 +10,49 @@
  */
 #include "ext2.h"
 
+#include "../../bio.h"
 #include "../../kernel.h"
+#include "../../mem.h"
 
-#define SBLOCK_PATTERN "LLLLLLLLLLLLLWWWWWWLLLLWWLWWLLLS16S16S64LBBWS16LLL"
-#define INODE_PATTERN "WWLLLLLWWLLLLLLLLLLLLLLLLLLLLLLS12"
+BIO_DECODER(decode_sblock, ext2_sblock, EXT2_SBLOCK_FIELDS)
+BIO_DECODER(decode_inode, ext2_inode, EXT2_INODE_FIELDS)
+BIO_ENCODER(encode_sblock, ext2_sblock, EXT2_SBLOCK_FIELDS)
+BIO_ENCODER(encode_inode, ext2_inode, EXT2_INODE_FIELDS)
+BIO_DECODER(decode_bgd, ext2_bgd, EXT2_BGD_FIELDS)
+BIO_DECODER(decode_dirent, ext2_dir_entry, EXT2_DIR_ENTRY_FIELDS)
 
-bool ext2_fsopen(ext2fs *fs, char *data)
+// Block group descriptors decoded at mount time, if they can't be viewed.
+static ext2_bgd bgdpool[EXT2_BGDPOOL];
+static u32 bgdpoolused;
+
+// Whether the on-disk structure at `raw` can be used in place as a structure
+// with the given alignment.
+static bool canview(ext2fs *fs, const void *raw, size_t align)
+{
+    return fs->views && (uintptr_t)raw % align == 0;
+}
+
+// The Block Group Descriptor Table starts at the block following the
+// superblock.
+static u32 bgdtblock(ext2fs *fs)
+{
+    return (2047 >> fs->blkshift) + 1;
+}
+
+bool ext2_fsopen(ext2fs *fs, blkdev *dev)
 {
     // Read the superblock. The superblock is always at 1K.
-    char *sblock = &data[1024];
-    readble(sblock, SBLOCK_PATTERN,
-        &fs->sblock.numinodes,
-        &fs->sblock.numblocks,
-        &fs->sblock.resblocks,
-        &fs->sblock.freeblocks,
-        &fs->sblock.freeinodes,
-        &fs->sblock.sblockno,
-        &fs->sblock.blksizesh,
-        &fs->sblock.fragsizesh,
-        &fs->sblock.grpblocks,
-        &fs->sblock.grpfrags,
-        &fs->sblock.grpinodes,
-        &fs->sblock.mounttime,
-        &fs->sblock.writtentime,
-        &fs->sblock.mounts,
-        &fs->sblock.fsckmounts,
-        &fs->sblock.signature,
-        &fs->sblock.fsstate,
-        &fs->sblock.errpolicy,
-        &fs->sblock.minorver,
-        &fs->sblock.fscktime,
-        &fs->sblock.fsckinterv,
-        &fs->sblock.os,
-        &fs->sblock.majorver,
-        &fs->sblock.resuid,
-        &fs->sblock.resgid,
-        &fs->sblock.firstino,
-        &fs->sblock.inosize,
-        &fs->sblock.blkgrp,
-        &fs->sblock.optfeatures,
-        &fs->sblock.reqfeatures,
-        &fs->sblock.rwreqfeatures,
-        &fs->sblock.fsid,
-        &fs->sblock.label,
-        &fs->sblock.lastmount,
-        &fs->sblock.compression,
-        &fs->sblock.allocfiles,
-        &fs->sblock.allocdirs,
-        &fs->sblock._unused,
-        &fs->sblock.journalid,
-        &fs->sblock.journalino,
-        &fs->sblock.journaldev,
-        &fs->sblock.orphanino);
+    buffer *bp = bread(dev, 1, 1024);
+    if (!bp) {
+        return false;
+    }
+    decode_sblock(&fs->sblock, (const u8*)bp->data);
 
     // Check the signature.
     if (fs->sblock.signature != 0xef53) {
         printf("Error: ext2: signature did not match (was: %4x)\n",
                 fs->sblock.signature);
+        brelse(bp);
         return false;
     }
 
@@ -74,19 +60,141 @@ bool ext2_fsopen(ext2fs *fs, char *data)
     if (fs->sblock.majorver != 1) {
         printf("Error: ext2: major version %u unsupported (use 1)\n",
                 fs->sblock.majorver);
+        brelse(bp);
+        return false;
+    }
+
+    // The superblock checksum covers it as stored.
+    bool csumok = ext2_csuminit(fs, (const u8*)bp->data);
+    brelse(bp);
+    if (!csumok) {
         return false;
     }
 
-    // Block size is 1024 shifted left by stored value. Panic if too large.
-    // FIXME: what is too large? (-> multiplied)
-    if (fs->sblock.blksizesh >= 22) {
-        printf("Error: ext2: Block size too large for 32 bit (1024 << %u)\n",
+    // Block size is 1024 shifted left by stored value. ext2 allows at most
+    // 64K, and the block map relies on that: it shifts by twice the log of
+    // the pointers per block, which must stay below 32.
+    if (fs->sblock.blksizesh > 6) {
+        printf("Error: ext2: Block size too large (1024 << %u)\n",
                 fs->sblock.blksizesh);
         return false;
     }
     fs->blksize = 1024 << fs->sblock.blksizesh;
+    fs->blkshift = 10 + fs->sblock.blksizesh;
+    if (!dev->mem && fs->blksize > BUF_MAXSIZE) {
+        printf("Error: ext2: Block size %u too large for the buffer cache\n",
+                fs->blksize);
+        return false;
+    }
+
+    // Inodes are indexed with shifts, so their size needs to be a power of
+    // two (which it always is in practice).
+    u16 inosize = fs->sblock.inosize;
+    if (inosize < 128 || inosize > fs->blksize || (inosize & (inosize - 1))) {
+        printf("Error: ext2: Bad inode size %u\n", inosize);
+        return false;
+    }
+    fs->inoshift = __builtin_ctz(inosize);
 
-    fs->data = data;
+    // Inodes per group is only a multiple of the inodes per block, so keep
+    // the division as a fallback.
+    u32 grpinodes = fs->sblock.grpinodes;
+    if (grpinodes == 0 || fs->sblock.grpblocks == 0) {
+        printf("Error: ext2: Empty block groups\n");
+        return false;
+    }
+    fs->grpinopow2 = !(grpinodes & (grpinodes - 1));
+    fs->grpinoshift = __builtin_ctz(grpinodes);
+
+    fs->numgroups = (fs->sblock.numblocks - fs->sblock.sblockno +
+            fs->sblock.grpblocks - 1) / fs->sblock.grpblocks;
+
+    // Inode numbers are mapped to groups without further checks.
+    if (fs->sblock.numblocks <= fs->sblock.sblockno || fs->numgroups == 0 ||
+            fs->sblock.numinodes > (u64)fs->numgroups * grpinodes) {
+        printf("Error: ext2: Bad group count\n");
+        return false;
+    }
+
+    // 64 bit filesystems have larger group descriptors, whose first 32 bytes
+    // are the ones we know. The upper halves of block numbers are all zero as
+    // long as there are less than 2^32 blocks.
+    fs->descsize = 32;
+    if (fs->sblock.reqfeatures & EXT2_FEATURE_64BIT) {
+        u32 descsize = fs->sblock.descsize;
+        if (descsize < 64 || descsize > fs->blksize ||
+                (descsize & (descsize - 1))) {
+            printf("Error: ext2: Bad group descriptor size %u\n", descsize);
+            return false;
+        }
+        if (fs->sblock.numblocks_hi) {
+            printf("Error: ext2: Too many blocks for 32 bit block numbers\n");
+            return false;
+        }
+        fs->descsize = descsize;
+    }
+
+    fs->dev = dev;
+
+    // The structure views need the device to be in memory, and our byte
+    // order to match the disk's.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    fs->views = dev->mem != 0;
+#else
+    fs->views = false;
+#endif
+
+    // Decode the Block Group Descriptor Table once.
+    u32 bgdtno = bgdtblock(fs);
+    const char *bgdt = fs->views ? &dev->mem[bgdtno << fs->blkshift] : 0;
+    if (bgdt && fs->descsize == sizeof(ext2_bgd) &&
+            canview(fs, bgdt, _Alignof(ext2_bgd))) {
+        for (u32 g = 0; g < fs->numgroups; g++) {
+            if (!ext2_bgdok(fs, g, (const u8*)&bgdt[g * fs->descsize])) {
+                return false;
+            }
+        }
+        fs->bgdt = (const ext2_bgd*)bgdt;
+    } else {
+        if (fs->numgroups > EXT2_BGDPOOL - bgdpoolused) {
+            printf("Error: ext2: Too many block groups (%u)\n",
+                    fs->numgroups);
+            return false;
+        }
+        ext2_bgd *pool = &bgdpool[bgdpoolused];
+        u32 perblock = fs->blksize / fs->descsize;
+        for (u32 g = 0; g < fs->numgroups; g += perblock) {
+            if (!(bp = ext2_bread(fs, bgdtno + g / perblock))) {
+                return false;
+            }
+            u32 n = fs->numgroups - g < perblock ? fs->numgroups - g :
+                    perblock;
+            for (u32 i = 0; i < n; i++) {
+                const u8 *raw = (const u8*)&bp->data[i * fs->descsize];
+                if (!ext2_bgdok(fs, g + i, raw)) {
+                    brelse(bp);
+                    return false;
+                }
+            }
+            decode_bgd_n(&pool[g], (const u8*)bp->data, fs->descsize, n);
+            brelse(bp);
+        }
+        bgdpoolused += fs->numgroups;
+        fs->bgdt = pool;
+    }
+
+    if (!ext2_allocinit(fs)) {
+        return false;
+    }
+
+    // We only write filesystems whose features we can keep up to date. A
+    // journal, if any, is left alone (and so stays empty).
+    fs->writable = !(fs->sblock.reqfeatures & ~EXT2_FEATURE_FILETYPE) &&
+            !(fs->sblock.rwreqfeatures & ~(EXT2_FEATURE_SPARSE_SUPER |
+            EXT2_FEATURE_LARGE_FILE)) && fs->blksize <= BUF_MAXSIZE &&
+            (dev->mem || dev->write || dev->start);
+    fs->mountstate = fs->sblock.fsstate;
+    fs->dirty = false;
 
     printf("ext2: Opened filesystem '%s' with %u blocks, %u inodes"
             "(%u, %u free), block size %u\n", fs->sblock.label,
@@ -96,76 +204,164 @@ bool ext2_fsopen(ext2fs *fs, char *data)
     return true;
 }
 
-bool ext2_readinode(ext2fs *fs, ext2_inode *buf, u32 ino)
+buffer *ext2_bread(ext2fs *fs, u32 blk)
 {
-    if (ino > fs->sblock.numinodes) {
-        return false;
+    return bread(fs->dev, blk, fs->blksize);
+}
+
+// Finds the on-disk inode `ino`. Returns the buffer holding it, with `raw`
+// pointing to the inode in it.
+static buffer *findinode(ext2fs *fs, u32 ino, const char **raw)
+{
+    if (ino == 0 || ino > fs->sblock.numinodes) {
+        return 0;
     }
 
     // Inodes are stored in block groups.
-    u32 group = (ino - 1) / fs->sblock.grpinodes;
-    u32 inoingrp = (ino - 1) % fs->sblock.grpinodes;
-    
-    // First, find the Block Group Descriptor Table. The BGDT starts at the
-    // block following the superblock.
-    u32 bgdtno = (2047 / fs->blksize) + 1;
-    char *bgdt = &fs->data[bgdtno * fs->blksize];
-
-    // Find the correct entry and the starting block of the inode table.
-    char *bgdtentry = &bgdt[group * 32];
-    u32 inotableno;
-    readble(&bgdtentry[8], "L", &inotableno);
+    u32 group, inoingrp;
+    if (fs->grpinopow2) {
+        group = (ino - 1) >> fs->grpinoshift;
+        inoingrp = (ino - 1) & (fs->sblock.grpinodes - 1);
+    } else {
+        group = (ino - 1) / fs->sblock.grpinodes;
+        inoingrp = (ino - 1) % fs->sblock.grpinodes;
+    }
 
     // FIXME: Tell if inode is not allocated
 
-    // Then index for the inode itself.
-    char *inotable = &fs->data[inotableno * fs->blksize];
-    char *inode = &inotable[inoingrp * fs->sblock.inosize];
-
-    // FIXME: Read symlink, device, diracl differently from blocks (endianness)
-    readble(inode, INODE_PATTERN,
-            &buf->mode,
-            &buf->uid,
-            &buf->size_lo,
-            &buf->atime,
-            &buf->ctime,
-            &buf->mtime,
-            &buf->deltime,
-            &buf->gid,
-            &buf->numlinks,
-            &buf->sectors,
-            &buf->flags,
-            &buf->oss1,
-            &buf->blocks[0],
-            &buf->blocks[1],
-            &buf->blocks[2],
-            &buf->blocks[3],
-            &buf->blocks[4],
-            &buf->blocks[5],
-            &buf->blocks[6],
-            &buf->blocks[7],
-            &buf->blocks[8],
-            &buf->blocks[9],
-            &buf->blocks[10],
-            &buf->blocks[11],
-            &buf->blockptr,
-            &buf->blockdptr,
-            &buf->blocktptr,
-            &buf->generation,
-            &buf->fileacl,
-            &buf->size_hi,
-            &buf->fragment,
-            &buf->oss2);
-
-    printf("Successfully read the inode with\n"
-            "Mode: %4o; Uid: %u; Gid: %u\n"
-            "Lower half of size: %u\n"
-            "Accessed: %u; Created: %u; Modified: %u; Deleted: %u\n"
-            "Hard links: %u; Disk sectors: %u\n"
-            "First block: %u\n",
-            buf->mode, buf->uid, buf->gid, buf->size_lo, buf->atime,
-            buf->ctime, buf->mtime, buf->deltime, buf->numlinks, buf->sectors,
-            buf->blocks[0]);
+    // Index the group's inode table for the inode itself.
+    u32 offset = inoingrp << fs->inoshift;
+    buffer *bp = ext2_bread(fs, fs->bgdt[group].inotable +
+            (offset >> fs->blkshift));
+    if (!bp) {
+        return 0;
+    }
+    *raw = &bp->data[offset & (fs->blksize - 1)];
 
+    // Groups whose inode table was never initialized have no checksums.
+    if (!(fs->bgdt[group].flags & EXT2_BG_INODE_UNINIT) &&
+            !ext2_inodeok(fs, ino, (const u8*)*raw)) {
+        brelse(bp);
+        return 0;
+    }
+    return bp;
+}
+
+bool ext2_readinode(ext2fs *fs, ext2_inode *buf, u32 ino)
+{
+    const char *raw;
+    buffer *bp = findinode(fs, ino, &raw);
+    if (!bp) {
+        return false;
+    }
+
+    decode_inode(buf, (const u8*)raw);
+    brelse(bp);
+
+    return true;
+}
+
+bool ext2_writeinode(ext2fs *fs, const ext2_inode *buf, u32 ino)
+{
+    const char *raw;
+    buffer *bp = findinode(fs, ino, &raw);
+    if (!bp) {
+        return false;
+    }
+
+    // Only the fields we know are written, the rest of the inode (extra
+    // fields of larger inodes) is kept.
+    encode_inode((u8*)raw, buf);
+    bdirty(bp);
+    brelse(bp);
     return true;
 }
+
+bool ext2_writebgd(ext2fs *fs, u32 group)
+{
+    u32 perblock = fs->blksize / fs->descsize;
+    buffer *bp = ext2_bread(fs, bgdtblock(fs) + group / perblock);
+    if (!bp) {
+        return false;
+    }
+
+    const ext2_group *grp = &fs->groups[group];
+    u8 *raw = (u8*)&bp->data[group % perblock * fs->descsize];
+    putle16(&raw[offsetof(ext2_bgd, freeblocks)], grp->freeblocks);
+    putle16(&raw[offsetof(ext2_bgd, freeinodes)], grp->freeinodes);
+    putle16(&raw[offsetof(ext2_bgd, numdirs)], grp->numdirs);
+    bdirty(bp);
+
+    // Viewed descriptors are the ones we just changed, decoded ones are a
+    // copy of them.
+    if ((const u8*)&fs->bgdt[group] != raw) {
+        decode_bgd((ext2_bgd*)&fs->bgdt[group], raw);
+    }
+    brelse(bp);
+    return true;
+}
+
+bool ext2_writesblock(ext2fs *fs)
+{
+    // The superblock is always at 1K.
+    buffer *bp = bread(fs->dev, 1, 1024);
+    if (!bp) {
+        return false;
+    }
+    encode_sblock((u8*)bp->data, &fs->sblock);
+    bool ok = bwrite(bp);
+    brelse(bp);
+    return ok;
+}
+
+const ext2_sblock *ext2_getsblock(ext2fs *fs)
+{
+    // The superblock is always at 1K.
+    if (fs->views && canview(fs, &fs->dev->mem[1024],
+            _Alignof(ext2_sblock))) {
+        return (const ext2_sblock*)&fs->dev->mem[1024];
+    }
+    return &fs->sblock;
+}
+
+const ext2_bgd *ext2_getbgd(ext2fs *fs, u32 group)
+{
+    if (group >= fs->numgroups) {
+        return 0;
+    }
+    return &fs->bgdt[group];
+}
+
+const ext2_inode *ext2_getinode(ext2fs *fs, ext2_inode *buf, u32 ino)
+{
+    const char *raw;
+    buffer *bp = findinode(fs, ino, &raw);
+    if (!bp) {
+        return 0;
+    }
+
+    // Memory backed blocks stay in place after the buffer is released.
+    const ext2_inode *ip = (const ext2_inode*)raw;
+    if (!canview(fs, raw, _Alignof(ext2_inode))) {
+        decode_inode(buf, (const u8*)raw);
+        ip = buf;
+    }
+    brelse(bp);
+    return ip;
+}
+
+const ext2_dir_entry *ext2_getdirent(ext2fs *fs, ext2_dir_entry *buf,
+        const char *raw, u32 avail)
+{
+    // The name length is a single byte, in the same place on any machine.
+    if (avail < sizeof *buf ||
+            (u8)raw[offsetof(ext2_dir_entry, namelen)] + sizeof *buf > avail) {
+        return 0;
+    }
+    if (canview(fs, raw, _Alignof(ext2_dir_entry))) {
+        return (const ext2_dir_entry*)raw;
+    }
+    decode_dirent(buf, (const u8*)raw);
+    memcpy(buf->name, &raw[sizeof *buf], buf->namelen);
+    return buf;
+}
@@ -13,6 +13,7 @@
 
 #include <stddef.h>
 
+#include "../../buf.h"
 #include "../../kernel.h"
 
 // The ext2 superblock as stored on disk.
@@ -85,12 +86,225 @@ typedef struct {
     u32 journalino;
     u32 journaldev;
     u32 orphanino;
+
+    u32 hashseed[4];    // Seed for directory index hashes.
+    u8 defhashver;      // Default directory index hash version.
+    u8 journalbackup;
+    u16 descsize;       // Group descriptor size (64 bit filesystems only).
+
+    u32 mountopts;      // Default mount options.
+    u32 firstmetabg;
+    u32 mkfstime;       // Time the filesystem was created.
+    u32 journalblocks[17];
+
+    u32 numblocks_hi;
+    u32 resblocks_hi;
+    u32 freeblocks_hi;
+    u16 mininosize;     // All inodes have at least this many extra bytes.
+    u16 wantinosize;    // New inodes should have this many extra bytes.
+
+    u32 flags;
+
+    // ext4 fields, only the ones for metadata checksums named.
+    char _ext4_0[17];
+    u8 csumtype;        // Checksum algorithm (EXT2_CSUM_CRC32C).
+    char _ext4_1[250];
+    u32 csumseed;       // Checksum seed, if EXT2_FEATURE_CSUM_SEED.
+    char _ext4_2[392];
+    u32 csum;           // Superblock checksum.
 } ext2_sblock;
 
+// Optional features (`optfeatures`).
+#define EXT2_FEATURE_DIR_INDEX 0x0020   // Hashed B-tree directories.
+
+// Required features (`reqfeatures`).
+#define EXT2_FEATURE_FILETYPE 0x0002    // File type in directory entries.
+#define EXT2_FEATURE_64BIT 0x0080       // 64 bit block numbers.
+#define EXT2_FEATURE_CSUM_SEED 0x2000   // Checksum seed in the superblock.
+
+// Features required for writing (`rwreqfeatures`).
+#define EXT2_FEATURE_SPARSE_SUPER 0x0001    // Fewer superblock backups.
+#define EXT2_FEATURE_LARGE_FILE 0x0002      // Files of 2G and more.
+#define EXT2_FEATURE_METADATA_CSUM 0x0400   // CRC-32C of metadata.
+
+// Superblock `fsstate`.
+#define EXT2_VALID_FS 0x0001    // Cleanly unmounted.
+#define EXT2_ERROR_FS 0x0002    // Errors detected.
+
+#define EXT2_CSUM_CRC32C 1
+
+// Superblock `flags`.
+#define EXT2_FLAGS_SIGNED_HASH 0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+// Field table of the superblock (see bio.h), in on-disk order.
+#define EXT2_SBLOCK_FIELDS(F) \
+    F(L, numinodes) \
+    F(L, numblocks) \
+    F(L, resblocks) \
+    F(L, freeblocks) \
+    F(L, freeinodes) \
+    F(L, sblockno) \
+    F(L, blksizesh) \
+    F(L, fragsizesh) \
+    F(L, grpblocks) \
+    F(L, grpfrags) \
+    F(L, grpinodes) \
+    F(L, mounttime) \
+    F(L, writtentime) \
+    F(W, mounts) \
+    F(W, fsckmounts) \
+    F(W, signature) \
+    F(W, fsstate) \
+    F(W, errpolicy) \
+    F(W, minorver) \
+    F(L, fscktime) \
+    F(L, fsckinterv) \
+    F(L, os) \
+    F(L, majorver) \
+    F(W, resuid) \
+    F(W, resgid) \
+    F(L, firstino) \
+    F(W, inosize) \
+    F(W, blkgrp) \
+    F(L, optfeatures) \
+    F(L, reqfeatures) \
+    F(L, rwreqfeatures) \
+    F(S, fsid) \
+    F(S, label) \
+    F(S, lastmount) \
+    F(L, compression) \
+    F(B, allocfiles) \
+    F(B, allocdirs) \
+    F(W, _unused) \
+    F(S, journalid) \
+    F(L, journalino) \
+    F(L, journaldev) \
+    F(L, orphanino) \
+    F(L, hashseed) \
+    F(B, defhashver) \
+    F(B, journalbackup) \
+    F(W, descsize) \
+    F(L, mountopts) \
+    F(L, firstmetabg) \
+    F(L, mkfstime) \
+    F(L, journalblocks) \
+    F(L, numblocks_hi) \
+    F(L, resblocks_hi) \
+    F(L, freeblocks_hi) \
+    F(W, mininosize) \
+    F(W, wantinosize) \
+    F(L, flags) \
+    F(S, _ext4_0) \
+    F(B, csumtype) \
+    F(S, _ext4_1) \
+    F(L, csumseed) \
+    F(S, _ext4_2) \
+    F(L, csum)
+
+// A block group descriptor as stored on disk, in the Block Group Descriptor
+// Table (BGDT).
 typedef struct {
-    char *data;         // Backing "device", only RAM disk for now.
+    u32 blkbitmap;  // Block number of the block usage bitmap.
+    u32 inobitmap;  // Block number of the inode usage bitmap.
+    u32 inotable;   // Starting block number of the inode table.
+
+    u16 freeblocks;
+    u16 freeinodes;
+    u16 numdirs;    // Number of directories in this group.
+
+    u16 flags;
+    u8 _reserved[10];
+    u16 csum;       // Low 16 bits of the CRC-32C, if metadata_csum.
+} ext2_bgd;
+
+// Block group descriptor `flags`.
+#define EXT2_BG_INODE_UNINIT 0x0001     // Inode table not initialized.
+#define EXT2_BG_BLOCK_UNINIT 0x0002     // Block bitmap not initialized.
+
+// Field table of a block group descriptor (see bio.h), in on-disk order.
+#define EXT2_BGD_FIELDS(F) \
+    F(L, blkbitmap) \
+    F(L, inobitmap) \
+    F(L, inotable) \
+    F(W, freeblocks) \
+    F(W, freeinodes) \
+    F(W, numdirs) \
+    F(W, flags) \
+    F(B, _reserved) \
+    F(W, csum)
+
+// A directory entry as stored on disk. Directory blocks are a list of these,
+// each `reclen` bytes long, with the (not null-terminated) name following the
+// fixed size header.
+typedef struct {
+    u32 ino;        // Inode number, 0 if the entry is unused.
+    u16 reclen;     // Total size of this entry, including the name.
+    u8 namelen;
+    u8 type;        // File type, if the filetype feature is enabled.
+    char name[];
+} ext2_dir_entry;
+
+#define EXT2_NAME_MAX 255
+
+// Field table of the directory entry header (see bio.h), in on-disk order.
+#define EXT2_DIR_ENTRY_FIELDS(F) \
+    F(L, ino) \
+    F(W, reclen) \
+    F(B, namelen) \
+    F(B, type)
+
+// Maximum number of block group descriptors decoded at mount time, across all
+// mounted filesystems. Only used if the BGDT cannot be viewed in place. Also
+// the number of groups allocation state is kept for.
+#define EXT2_BGDPOOL 1024
+
+// In-core allocation state of a block group (see alloc.c).
+typedef struct {
+    u32 freeblocks;
+    u32 freeinodes;
+    u32 numdirs;
+    u32 blkhint;        // There are no free blocks before this one...
+    u32 inohint;        // ...and no free inodes before this one.
+    bool dirty;         // Counts differ from the group descriptor.
+} ext2_group;
+
+typedef struct {
+    u32 blocks;     // Blocks allocated.
+    u32 freed;      // Blocks freed.
+    u32 inodes;     // Inodes allocated.
+    u32 words;      // Bitmap words scanned.
+    u32 skipped;    // Groups passed over without reading their bitmaps.
+    u32 discarded;  // Blocks allocated ahead for a file and freed unused.
+} ext2_alloc_stats;
+
+typedef struct {
+    blkdev *dev;        // Backing device.
     u32 blksize;        // Block size.
+    bool views;         // Whether structures can be viewed in place.
     ext2_sblock sblock;
+
+    // Geometry, precomputed at mount time so that lookups need no divisions.
+    u8 blkshift;        // block size = 1 << blkshift
+    u8 inoshift;        // inode size = 1 << inoshift
+    u8 grpinoshift;     // inodes per group = 1 << grpinoshift, if grpinopow2
+    bool grpinopow2;    // Whether inodes per group is a power of two.
+    u32 numgroups;
+    u32 descsize;       // Size of a group descriptor on disk.
+
+    const ext2_bgd *bgdt; // All block group descriptors, decoded at mount.
+
+    ext2_group *groups; // Allocation state of every group.
+    u32 freeblocks;     // Free blocks in the groups we allocate from...
+    u32 resvblocks;     // ...of which are set aside for delayed blocks.
+
+    bool csum;          // Metadata checksums are verified.
+    u32 csumseed;       // CRC-32C of the filesystem UUID (see csum.c).
+
+    bool writable;      // We can keep all of its features up to date.
+    u16 mountstate;     // `fsstate` when mounted, restored on ext2_sync().
+    bool dirty;         // Changed since the last ext2_sync()...
+    u32 dirtied;        // ...first at this ticks().
 } ext2fs;
 
 // An ext2 inode as stored on disk.
@@ -140,7 +354,375 @@ typedef struct {
     u8 oss2[12];    // OS Specific Value #2.
 } ext2_inode;
 
-bool ext2_fsopen(ext2fs *fs, char *data);
+// Inode types, in the upper bits of `mode`.
+#define EXT2_S_IFMT 0xf000
+#define EXT2_S_IFDIR 0x4000
+#define EXT2_S_IFREG 0x8000
+#define EXT2_S_IFLNK 0xa000
+
+// File types in directory entries, if the filetype feature is enabled.
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR 2
+#define EXT2_FT_SYMLINK 7
+
+// Inode `flags`.
+#define EXT2_INDEX_FL 0x00001000        // Directory has a hashed index.
+
+// Inode number of the root directory.
+#define EXT2_ROOT_INO 2
+
+// Field table of an inode (see bio.h), in on-disk order. Unions are decoded
+// through their first member.
+// FIXME: Read symlink, device, diracl differently from blocks (endianness)
+#define EXT2_INODE_FIELDS(F) \
+    F(W, mode) \
+    F(W, uid) \
+    F(L, size_lo) \
+    F(L, atime) \
+    F(L, ctime) \
+    F(L, mtime) \
+    F(L, deltime) \
+    F(W, gid) \
+    F(W, numlinks) \
+    F(L, sectors) \
+    F(L, flags) \
+    F(L, oss1) \
+    F(L, blocks) \
+    F(L, blockptr) \
+    F(L, blockdptr) \
+    F(L, blocktptr) \
+    F(L, generation) \
+    F(L, fileacl) \
+    F(L, size_hi) \
+    F(L, fragment) \
+    F(B, oss2)
+
+// Sizes of the per-inode block map cache (see file.c).
+#define EXT2_NMAPRUNS 8
+#define EXT2_NMAPLEAVES 4
+
+// Remembers recently resolved parts of a file's block map, so that accesses
+// deep into large files don't have to walk the indirect blocks every time.
+typedef struct {
+    // Runs of logical blocks that are also contiguous on disk.
+    struct {
+        u32 lblk;
+        u32 pblk;
+        u32 len;    // 0 if unused.
+    } runs[EXT2_NMAPRUNS];
+
+    // Doubly and triply indirect blocks resolve to a leaf indirect block
+    // holding the final pointers. `first` is the first logical block the
+    // leaf maps.
+    struct {
+        u32 first;  // 0 if unused (logical block 0 is always direct).
+        u32 blk;
+    } leaves[EXT2_NMAPLEAVES];
+
+    u8 nextrun;     // Round robin replacement.
+    u8 nextleaf;
+} ext2_bmapcache;
+
+typedef struct {
+    u32 lookups;
+    u32 runhits;    // Lookups answered from a cached run.
+    u32 leafhits;   // Lookups that only needed to read a cached leaf.
+    u32 derefs;     // Indirect block pointers followed.
+    u32 saved;      // Indirect block pointers not followed thanks to the cache.
+} ext2_bmap_stats;
+
+// An in-core inode: a cached copy of an on-disk inode (see icache.c).
+typedef struct ext2_incore {
+    ext2fs *fs;         // Filesystem, 0 if the entry is free.
+    u32 ino;
+    u32 refs;           // Number of ext2_iget() without matching ext2_iput().
+    ext2_inode inode;
+    ext2_bmapcache bmap;
+    bool dirty;         // `inode` is newer than the one on disk.
+    bool orphan;        // Unlinked, deleted on the last ext2_iput().
+    u32 ndelay;         // Blocks waiting for allocation (see write.c).
+    u32 prealloc;       // Blocks [prealloc, prealloc + nprealloc) are...
+    u32 nprealloc;      // ...allocated ahead for the next ones (see alloc.c).
+
+    struct ext2_incore *hnext;  // Next entry in the same hash bucket.
+    struct ext2_incore *lprev;  // LRU list of unreferenced entries.
+    struct ext2_incore *lnext;
+} ext2_incore;
+
+// Size of the inode cache. As in UNIX, this is a fixed table, so the memory
+// used by the cache is bounded by `EXT2_NINODE * sizeof(ext2_incore)`.
+#define EXT2_NINODE 64
+
+typedef struct {
+    u32 hits;
+    u32 misses;
+    u32 evictions;  // Cached inodes dropped to make room for others.
+} ext2_icache_stats;
+
+// Size of the directory entry cache (see namei.c), and the longest name it
+// caches. Longer names are always looked up in the directory.
+#define EXT2_NDENTRY 128
+#define EXT2_DNAME_MAX 27
+
+typedef struct {
+    u32 hits;       // Lookups answered from the cache, including...
+    u32 neghits;    // ...lookups answered with a cached "does not exist".
+    u32 misses;     // Lookups that scanned the directory.
+} ext2_dcache_stats;
+
+// Position in a directory for ext2_readdir(). Zero it to start at the
+// beginning of the directory.
+typedef struct {
+    u32 offset;     // Byte offset of the next entry in the directory.
+
+    // Block map of the current and next block, so that every call need not
+    // look them up again.
+    u32 mapped;     // Logical block number + 1 of `pblk`, 0 if none.
+    u32 pblk;
+    u32 nextpblk;
+} ext2_dircursor;
+
+// A segment of a file mapped by ext2_map().
+typedef struct {
+    const char *data;   // 0 for holes, which read as zeroes.
+    u32 len;
+} ext2_seg;
+
+// Readahead window sizes in blocks (see readahead.c). Before a fetched block
+// is read, the window's worth of blocks fetched after it and as many blocks
+// read are released after it, so a window larger than a quarter of the
+// buffer cache has blocks reclaimed before they are read.
+#define EXT2_RAMIN 4
+#define EXT2_RAMAX (NBUF / 4)
+
+// Readahead state of an open file.
+typedef struct {
+    u32 next;       // Block a sequential read would start at.
+    u32 window;     // Blocks to keep fetched ahead of the reader, 0 if off.
+    u32 start;      // Blocks [start, end) are fetched and not read yet.
+    u32 end;
+} ext2_readahead;
+
+typedef struct {
+    u32 issued;     // Blocks fetched ahead, holes included.
+    u32 hits;       // Fetched blocks that were then read...
+    u32 wasted;     // ...and the ones that weren't.
+    u32 grows;      // Window changes on sequential and random reads.
+    u32 shrinks;
+} ext2_ra_stats;
+
+// Number of file blocks written and not allocated yet, across all
+// filesystems (see write.c). Each takes `BUF_MAXSIZE` bytes of memory.
+#define EXT2_NDELAY 64
+
+// Milliseconds changes wait in memory before being written to the disk.
+#define EXT2_SYNC_INTERVAL 5000
+
+typedef struct {
+    u32 delayed;    // Blocks written before they had a place on disk.
+    u32 flushed;    // Blocks given a place on disk...
+    u32 runs;       // ...in this many allocations.
+    u32 syncs;      // Times everything was written to disk.
+} ext2_write_stats;
+
+// An open file: an in-core inode and a position in it.
+typedef struct {
+    ext2_incore *ip;
+    u32 pos;
+    ext2_readahead ra;
+} ext2_file;
+
+bool ext2_fsopen(ext2fs *fs, blkdev *dev);
 bool ext2_readinode(ext2fs *fs, ext2_inode *buf, u32 ino);
+// Store an inode, the free counts of group `group`, or the superblock
+// (`fs->sblock`, written through right away) back to their blocks.
+bool ext2_writeinode(ext2fs *fs, const ext2_inode *buf, u32 ino);
+bool ext2_writebgd(ext2fs *fs, u32 group);
+bool ext2_writesblock(ext2fs *fs);
+// Reads filesystem block `blk` through the buffer cache. Release it with
+// brelse().
+buffer *ext2_bread(ext2fs *fs, u32 blk);
+
+// Maps logical block `lblk` of a file to its block number on disk. Returns 0
+// for holes and blocks past the ones addressable by the inode.
+u32 ext2_bmap(ext2fs *fs, const ext2_inode *inode, u32 lblk);
+// Reads up to `len` bytes at `offset` of a file into `buf`. Returns the number
+// of bytes read, which is less than `len` only at the end of the file.
+u32 ext2_read(ext2fs *fs, const ext2_inode *inode, u32 offset, void *buf,
+        u32 len);
+// Same as ext2_bmap() and ext2_read(), for an in-core inode, using and
+// filling its block map cache.
+u32 ext2_ibmap(ext2_incore *ip, u32 lblk);
+u32 ext2_iread(ext2_incore *ip, u32 offset, void *buf, u32 len);
+// Maps up to `len` bytes at `offset` of a file on a memory backed device
+// without copying anything: fills up to `nsegs` segments pointing straight
+// into the device, one per run of blocks that are contiguous on disk, and
+// returns how many. Together they cover the range, unless it goes past the
+// end of the file or `nsegs` runs out; map the rest with another call. The
+// file's delayed data is flushed first, so this allocates its blocks on
+// disk. The segments are for reading only, are valid until the file is
+// truncated or deleted, and see later writes to the file's blocks. Returns
+// -1 if the device isn't memory backed or the flush fails.
+int ext2_map(ext2_incore *ip, u32 offset, u32 len, ext2_seg *segs,
+        u32 nsegs);
+void ext2_bmapstats(ext2_bmap_stats *stats);
+// Maps logical block `lblk` of a file to `pblk` (0 for a hole). Missing
+// indirect blocks are allocated at `*goal` onwards, which is moved past them.
+// Returns false if they can't be.
+bool ext2_setmap(ext2_incore *ip, u32 lblk, u32 pblk, u32 *goal);
+// Logical block following the last one whose pointer is in the same block as
+// that of `lblk` (the inode or a leaf indirect block).
+u32 ext2_leafend(ext2fs *fs, u32 lblk);
+// Number of indirect blocks above the pointer to logical block `lblk`.
+u32 ext2_mapdepth(ext2fs *fs, u32 lblk);
+// Frees the blocks of a file from logical block `keep` on, the indirect blocks
+// left empty, and the blocks allocated ahead for it.
+void ext2_itrunc(ext2_incore *ip, u32 keep);
+
+// Opens `ip` for reading at position 0. The file holds its own reference to
+// the inode until ext2_fclose(). Returns false if it can't be referenced.
+bool ext2_fopen(ext2_file *f, ext2_incore *ip);
+void ext2_fclose(ext2_file *f);
+// Reads up to `len` bytes at the file position, fetching blocks ahead of
+// sequential readers, and advances the position. Returns the number of bytes
+// read, which is less than `len` only at the end of the file.
+u32 ext2_fread(ext2_file *f, void *buf, u32 len);
+void ext2_fseek(ext2_file *f, u32 pos);
+void ext2_rastats(ext2_ra_stats *stats);
+
+// Gets a referenced in-core inode, reading it if it is not cached. Returns 0
+// if the inode can't be read or every cache entry is referenced.
+ext2_incore *ext2_iget(ext2fs *fs, u32 ino);
+// Releases a reference obtained from ext2_iget().
+void ext2_iput(ext2_incore *ip);
+// Marks an in-core inode as changed. It is written back on ext2_isync() or
+// when it leaves the cache.
+void ext2_idirty(ext2_incore *ip);
+// Writes back all changed in-core inodes of `fs` to their blocks.
+bool ext2_isync(ext2fs *fs);
+// Drops all unreferenced cached inodes of `fs`.
+void ext2_iflush(ext2fs *fs);
+void ext2_icachestats(ext2_icache_stats *stats);
+
+// Writing (see write.c). Data written to blocks the file doesn't have yet
+// stays in memory, and is only given blocks on disk when flushed, so that
+// the blocks of a file written sequentially end up in a row. Everything is
+// flushed on ext2_sync(), when there is no more room for delayed blocks, and
+// by the first change made `EXT2_SYNC_INTERVAL` ms or more after the oldest
+// unsynced one. Nothing syncs in the background, so the last changes stay in
+// memory until ext2_sync() is called.
+// ext2_write() returns the number of bytes written, which falls short when
+// the filesystem is full. ext2_create() returns a referenced in-core inode
+// for a new file or (if `mode` says so) directory.
+u32 ext2_write(ext2_incore *ip, u32 offset, const void *buf, u32 len);
+bool ext2_truncate(ext2_incore *ip, u32 size);
+ext2_incore *ext2_create(ext2_incore *dir, const char *name, u32 len,
+        u16 mode);
+bool ext2_unlink(ext2_incore *dir, const char *name, u32 len);
+// Writes all changes to `fs` to the disk, and gives it back the state it was
+// mounted with (clean, if it was). A failed sync marks it as having errors.
+bool ext2_sync(ext2fs *fs);
+// Marks `fs` as changed, and as not cleanly unmounted on disk.
+void ext2_touch(ext2fs *fs);
+// Delayed data of block `lblk` of a file, or 0 if it has none.
+const char *ext2_delayed(ext2_incore *ip, u32 lblk);
+// Gives the delayed blocks of a file their place on disk, and moves them to
+// the buffer cache. Called before the inode leaves the inode cache.
+bool ext2_iflushdelayed(ext2_incore *ip);
+// Frees an orphan inode and its blocks. Called on its last ext2_iput().
+void ext2_idelete(ext2_incore *ip);
+void ext2_wstats(ext2_write_stats *stats);
+
+// Looks up the `len` byte long `name` in directory `dir`, and sets `*ino` to
+// its inode number, or 0 if there is no such entry. Returns false if the
+// directory can't be read or is corrupt.
+bool ext2_lookup(ext2_incore *dir, const char *name, u32 len, u32 *ino);
+// Resolves `path` (relative to the root directory) to a referenced in-core
+// inode. Returns 0 if any component does not exist.
+ext2_incore *ext2_namei(ext2fs *fs, const char *path);
+// Reads as many directory entries as fit into `buf`, starting at `cur`, and
+// advances `cur` past them. Entries are returned as `ext2_dir_entry` in our
+// byte order, with `reclen` the size of the returned record (4 byte aligned)
+// and the name null-terminated. `buf` must be 4 byte aligned. Returns the
+// number of bytes written, 0 at the end of the directory and -1 if `dir` is
+// not a directory or `buf` can't hold the next entry.
+int ext2_readdir(ext2_incore *dir, ext2_dircursor *cur, void *buf, u32 size);
+// Searches logical block `lblk` of directory `dir` for `name`, and sets `*ino`
+// to its inode number, or 0 if it is not in this block. Returns false if the
+// block can't be read or has a bad entry.
+bool ext2_dirsearch(ext2_incore *dir, u32 lblk, const char *name, u32 len,
+        u32 *ino);
+// Adds an entry for inode `ino` of type `mode` to directory `dir`, growing
+// it by a block if no block has room. Directory indexes aren't updated, so
+// the directory stops being indexed.
+bool ext2_diradd(ext2_incore *dir, const char *name, u32 len, u32 ino,
+        u16 mode);
+// Removes the entry `name` from directory `dir`. Returns the inode number it
+// had, or 0 if there is no such entry.
+u32 ext2_dirremove(ext2_incore *dir, const char *name, u32 len);
+// Block and inode allocation (see alloc.c). ext2_allocinit() sets up the
+// allocation state at mount. ext2_balloc() allocates up to `want` blocks in a
+// row, as close after `goal` as it can. It returns the first block and the
+// number allocated in `*got`, or 0 if the filesystem is full.
+// ext2_prealloc() is the number of blocks the superblock suggests allocating
+// at once for a file or directory. ext2_iballoc() is ext2_balloc() for the
+// file `ip`, allocating at least that many: the ones not returned are kept
+// for the file's next allocation at the block after them, until
+// ext2_idiscard() frees them. ext2_ialloc() allocates an inode for a new file
+// or directory in directory `parent`, or returns 0. ext2_breserve() sets `n`
+// free blocks aside, which ext2_balloc() leaves alone until
+// ext2_bunreserve() gives them back, or returns false if there aren't that
+// many.
+bool ext2_allocinit(ext2fs *fs);
+u32 ext2_balloc(ext2fs *fs, u32 goal, u32 want, u32 *got);
+bool ext2_breserve(ext2fs *fs, u32 n);
+void ext2_bunreserve(ext2fs *fs, u32 n);
+u32 ext2_prealloc(ext2fs *fs, bool dir);
+u32 ext2_iballoc(ext2_incore *ip, u32 goal, u32 want, u32 *got);
+void ext2_idiscard(ext2_incore *ip);
+void ext2_bfree(ext2fs *fs, u32 blk, u32 count);
+u32 ext2_ialloc(ext2fs *fs, u32 parent, bool dir);
+void ext2_ifree(ext2fs *fs, u32 ino, bool dir);
+void ext2_allocstats(ext2_alloc_stats *stats);
+// Skips the whole 512 bit chunks from `start` on and below `end` that have
+// no bit clear (`set` false) or set (`set` true). Returns where to go on
+// scanning from, at or after `start`. SSE2, see alloc_simd.c.
+u32 ext2_bitskip_simd(const u8 *map, u32 start, u32 end, bool set);
+// Metadata checksums (see csum.c). ext2_csuminit() checks the raw superblock
+// and enables verification if the filesystem has metadata_csum. The others
+// check a raw on-disk block group descriptor or inode, and are true if
+// verification is disabled.
+bool ext2_csuminit(ext2fs *fs, const u8 *raw);
+bool ext2_bgdok(ext2fs *fs, u32 group, const u8 *raw);
+bool ext2_inodeok(ext2fs *fs, u32 ino, const u8 *raw);
+// Hashes a name for the directory index of `fs` (see htree.c).
+u32 ext2_dxhash(ext2fs *fs, unsigned version, const char *name, u32 len);
+// Looks up `name` through the hashed index of directory `dir`. Returns false
+// if the directory has no usable index or a leaf can't be read, and needs to
+// be scanned linearly.
+bool ext2_dxlookup(ext2_incore *dir, const char *name, u32 len, u32 *ino);
+// Sets the cached entry `name` of directory `parent` to `ino` (0: does not
+// exist), after the directory changed.
+void ext2_dset(ext2fs *fs, u32 parent, const char *name, u32 len, u32 ino);
+// Drops all cached directory entries of `fs`.
+void ext2_dflush(ext2fs *fs);
+void ext2_dcachestats(ext2_dcache_stats *stats);
+
+// In-place views. On little endian machines, on-disk structures have the
+// same layout as ours, so if the filesystem is on a memory backed device (a
+// RAM disk) and the structure is suitably aligned, these return read-only
+// pointers straight into the device without copying or decoding anything.
+// Otherwise they decode into `buf` and return that. They return 0 on error.
+// Views are valid for as long as the filesystem is open.
+const ext2_sblock *ext2_getsblock(ext2fs *fs);
+// Block group descriptors are decoded at mount time, so this never copies.
+const ext2_bgd *ext2_getbgd(ext2fs *fs, u32 group);
+const ext2_inode *ext2_getinode(ext2fs *fs, ext2_inode *buf, u32 ino);
+// `raw` points to an entry in a directory block, and the view is only valid
+// for as long as that block's buffer is held. `buf` needs to have room for a
+// name of `EXT2_NAME_MAX` bytes. Returns 0 if the entry header or its name
+// runs past the `avail` bytes left in the block.
+const ext2_dir_entry *ext2_getdirent(ext2fs *fs, ext2_dir_entry *buf,
+        const char *raw, u32 avail);
 
 #endif
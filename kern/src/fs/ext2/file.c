@@ -0,0 +1,532 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/file.c
+ * ext2 file data
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../bio.h"
+#include "../../kernel.h"
+#include "../../mem.h"
+
+// Number of direct block pointers in an inode.
+#define NDIRECT 12
+
+// Returns entry `n` of the indirect block `blk`.
+static u32 indirect(ext2fs *fs, u32 blk, u32 n)
+{
+    if (blk == 0) {
+        return 0;
+    }
+    buffer *bp = ext2_bread(fs, blk);
+    if (!bp) {
+        return 0;
+    }
+    u32 ptr = getle32((const u8*)&bp->data[n * 4]);
+    brelse(bp);
+    return ptr;
+}
+
+static ext2_bmap_stats stats;
+
+// Looks `lblk` up in the cached runs.
+static bool findrun(ext2_bmapcache *cache, u32 lblk, u32 *pblk)
+{
+    for (unsigned i = 0; i < EXT2_NMAPRUNS; i++) {
+        if (lblk - cache->runs[i].lblk < cache->runs[i].len) {
+            *pblk = cache->runs[i].pblk + (lblk - cache->runs[i].lblk);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remembers that `lblk` maps to `pblk`, growing a run if it directly follows
+// one.
+static void addrun(ext2_bmapcache *cache, u32 lblk, u32 pblk)
+{
+    for (unsigned i = 0; i < EXT2_NMAPRUNS; i++) {
+        if (cache->runs[i].len &&
+                lblk == cache->runs[i].lblk + cache->runs[i].len &&
+                pblk == cache->runs[i].pblk + cache->runs[i].len) {
+            cache->runs[i].len++;
+            return;
+        }
+    }
+
+    unsigned i = cache->nextrun++ % EXT2_NMAPRUNS;
+    cache->runs[i].lblk = lblk;
+    cache->runs[i].pblk = pblk;
+    cache->runs[i].len = 1;
+}
+
+static bool findleaf(ext2_bmapcache *cache, u32 first, u32 *blk)
+{
+    for (unsigned i = 0; i < EXT2_NMAPLEAVES; i++) {
+        if (cache->leaves[i].first == first) {
+            *blk = cache->leaves[i].blk;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void addleaf(ext2_bmapcache *cache, u32 first, u32 blk)
+{
+    unsigned i = cache->nextleaf++ % EXT2_NMAPLEAVES;
+    cache->leaves[i].first = first;
+    cache->leaves[i].blk = blk;
+}
+
+// Resolves the leaf indirect block for index `n` (relative to the start of
+// the doubly or triply indirect blocks) by following `levels` indirect
+// blocks starting at `top`.
+static u32 walk(ext2fs *fs, u32 top, u32 n, unsigned levels)
+{
+    unsigned ptrshift = fs->blkshift - 2;
+    u32 ptrmask = (1 << ptrshift) - 1;
+
+    u32 blk = top;
+    for (unsigned l = levels; l > 0; l--) {
+        blk = indirect(fs, blk, (n >> (l * ptrshift)) & ptrmask);
+        stats.derefs++;
+    }
+    return blk;
+}
+
+static u32 bmap(ext2fs *fs, const ext2_inode *inode, ext2_bmapcache *cache,
+        u32 lblk)
+{
+    // The first blocks are pointed to directly by the inode, the following
+    // ones through one, two or three levels of indirect blocks, each holding
+    // 2^ptrshift block pointers.
+    unsigned ptrshift = fs->blkshift - 2;
+    u32 ptrmask = (1 << ptrshift) - 1;
+
+    stats.lookups++;
+
+    if (lblk < NDIRECT) {
+        return inode->blocks[lblk];
+    }
+    u32 n = lblk - NDIRECT;
+
+    // Number of indirect blocks to follow, and the first of them.
+    unsigned levels;
+    u32 top;
+    if (n >> ptrshift == 0) {
+        levels = 1;
+        top = inode->blockptr;
+    } else if ((n -= 1 << ptrshift) >> (2 * ptrshift) == 0) {
+        levels = 2;
+        top = inode->blockdptr;
+    } else {
+        n -= 1 << (2 * ptrshift);
+        // The triply indirect blocks address 2^(3 * ptrshift) blocks (2^24
+        // with 1K blocks). From 8K blocks on, that is more than a u32 holds,
+        // and the check is skipped.
+        if (3 * ptrshift < 32 && n >> (3 * ptrshift) != 0) {
+            return 0;
+        }
+        levels = 3;
+        top = inode->blocktptr;
+    }
+
+    u32 pblk;
+    if (cache && findrun(cache, lblk, &pblk)) {
+        stats.runhits++;
+        stats.saved += levels;
+        return pblk;
+    }
+
+    // Find the leaf indirect block, which holds the pointer to our block.
+    u32 leaf;
+    u32 first = lblk - (n & ptrmask);
+    if (levels == 1) {
+        leaf = top;
+    } else if (cache && findleaf(cache, first, &leaf)) {
+        stats.leafhits++;
+        stats.saved += levels - 1;
+    } else {
+        leaf = walk(fs, top, n, levels - 1);
+        if (cache) {
+            addleaf(cache, first, leaf);
+        }
+    }
+
+    pblk = indirect(fs, leaf, n & ptrmask);
+    stats.derefs++;
+    if (cache && pblk) {
+        addrun(cache, lblk, pblk);
+    }
+    return pblk;
+}
+
+u32 ext2_bmap(ext2fs *fs, const ext2_inode *inode, u32 lblk)
+{
+    return bmap(fs, inode, 0, lblk);
+}
+
+u32 ext2_ibmap(ext2_incore *ip, u32 lblk)
+{
+    return bmap(ip->fs, &ip->inode, &ip->bmap, lblk);
+}
+
+void ext2_bmapstats(ext2_bmap_stats *out)
+{
+    *out = stats;
+}
+
+// Copies `len` bytes, starting `inblk` bytes into block `pblk` and going on
+// through the blocks following it.
+static bool copyrun(ext2fs *fs, char *dest, u32 pblk, u32 inblk, u32 len)
+{
+    blkdev *dev = fs->dev;
+    if (dev->mem) {
+        // Memory backed devices have the whole run in place.
+        u64 start = ((u64)pblk << fs->blkshift) + inblk;
+        if (start + len > dev->size) {
+            printf("Error: ext2: block %u out of range\n", pblk);
+            return false;
+        }
+        memcpy(dest, &dev->mem[start], len);
+        return true;
+    }
+
+    while (len) {
+        buffer *bp = ext2_bread(fs, pblk++);
+        if (!bp) {
+            return false;
+        }
+        u32 n = fs->blksize - inblk < len ? fs->blksize - inblk : len;
+        memcpy(dest, &bp->data[inblk], n);
+        brelse(bp);
+        dest += n;
+        len -= n;
+        inblk = 0;
+    }
+    return true;
+}
+
+// Length of the run starting `inblk` bytes into logical block `lblk` of a
+// file, which maps to `pblk`, up to `left` bytes. The run goes on for as
+// long as the following blocks of the file are also the following blocks on
+// disk, or holes after a hole, so that it can be handled at once.
+static u32 runlength(ext2fs *fs, const ext2_inode *inode, ext2_incore *ip,
+        u32 lblk, u32 pblk, u32 inblk, u32 left)
+{
+    ext2_bmapcache *cache = ip ? &ip->bmap : 0;
+    bool delayed = ip && ip->ndelay;
+    u32 runlen = fs->blksize - inblk;
+    for (u32 n = 1; runlen < left; n++) {
+        u32 next = bmap(fs, inode, cache, lblk + n);
+        if (next != (pblk ? pblk + n : 0) ||
+                (!next && delayed && ext2_delayed(ip, lblk + n))) {
+            break;
+        }
+        runlen += fs->blksize;
+    }
+    return runlen < left ? runlen : left;
+}
+
+// Reads from `inode`, or from the in-core inode `ip` if there is one, which
+// also has delayed blocks that are not on disk yet.
+static u32 readfile(ext2fs *fs, const ext2_inode *inode, ext2_incore *ip,
+        u32 offset, void *buf, u32 len)
+{
+    ext2_bmapcache *cache = ip ? &ip->bmap : 0;
+    // FIXME: Files larger than 4G (size_hi).
+    u32 size = inode->size_lo;
+    if (offset >= size) {
+        return 0;
+    }
+    if (len > size - offset) {
+        len = size - offset;
+    }
+
+    char *dest = buf;
+    u32 done = 0;
+    while (done < len) {
+        u32 lblk = (offset + done) >> fs->blkshift;
+        u32 inblk = (offset + done) & (fs->blksize - 1);
+        u32 pblk = bmap(fs, inode, cache, lblk);
+
+        const char *delayed = !pblk && ip && ip->ndelay ?
+                ext2_delayed(ip, lblk) : 0;
+        if (delayed) {
+            u32 n = fs->blksize - inblk;
+            n = n < len - done ? n : len - done;
+            memcpy(&dest[done], &delayed[inblk], n);
+            done += n;
+            continue;
+        }
+
+        u32 runlen = runlength(fs, inode, ip, lblk, pblk, inblk, len - done);
+        if (pblk == 0) {
+            // Holes read as zeroes.
+            memset(&dest[done], 0, runlen);
+        } else if (!copyrun(fs, &dest[done], pblk, inblk, runlen)) {
+            break;
+        }
+        done += runlen;
+    }
+
+    return done;
+}
+
+u32 ext2_read(ext2fs *fs, const ext2_inode *inode, u32 offset, void *buf,
+        u32 len)
+{
+    return readfile(fs, inode, 0, offset, buf, len);
+}
+
+u32 ext2_iread(ext2_incore *ip, u32 offset, void *buf, u32 len)
+{
+    return readfile(ip->fs, &ip->inode, ip, offset, buf, len);
+}
+
+int ext2_map(ext2_incore *ip, u32 offset, u32 len, ext2_seg *segs,
+        u32 nsegs)
+{
+    ext2fs *fs = ip->fs;
+    blkdev *dev = fs->dev;
+    if (!dev->mem) {
+        return -1;
+    }
+    // Delayed blocks have no place in the device yet. They are given one,
+    // just as on a sync.
+    if (ip->ndelay && !ext2_iflushdelayed(ip)) {
+        return -1;
+    }
+
+    u32 size = ip->inode.size_lo;
+    if (offset >= size) {
+        return 0;
+    }
+    if (len > size - offset) {
+        len = size - offset;
+    }
+
+    u32 done = 0;
+    u32 n = 0;
+    while (done < len && n < nsegs) {
+        u32 lblk = (offset + done) >> fs->blkshift;
+        u32 inblk = (offset + done) & (fs->blksize - 1);
+        u32 pblk = ext2_ibmap(ip, lblk);
+        u32 runlen = runlength(fs, &ip->inode, ip, lblk, pblk, inblk,
+                len - done);
+
+        const char *data = 0;
+        if (pblk) {
+            u64 start = ((u64)pblk << fs->blkshift) + inblk;
+            if (start + runlen > dev->size) {
+                printf("Error: ext2: block %u out of range\n", pblk);
+                return -1;
+            }
+            data = &dev->mem[start];
+        }
+        segs[n++] = (ext2_seg) {
+            .data = data,
+            .len = runlen,
+        };
+        done += runlen;
+    }
+    return n;
+}
+
+// Finds the pointer to logical block `lblk` for changing it: `*top` is set
+// to the inode's pointer it hangs off, and `idx` to the entry to follow in
+// each indirect block below that. Returns the number of indirect blocks, or
+// -1 if the block is past the ones addressable by the inode.
+static int path(ext2fs *fs, ext2_inode *inode, u32 lblk, u32 **top,
+        u32 idx[3])
+{
+    unsigned ptrshift = fs->blkshift - 2;
+    u32 ptrmask = (1 << ptrshift) - 1;
+
+    if (lblk < NDIRECT) {
+        *top = &inode->blocks[lblk];
+        return 0;
+    }
+    u32 n = lblk - NDIRECT;
+
+    int levels;
+    if (n >> ptrshift == 0) {
+        levels = 1;
+        *top = &inode->blockptr;
+    } else if ((n -= 1 << ptrshift) >> (2 * ptrshift) == 0) {
+        levels = 2;
+        *top = &inode->blockdptr;
+    } else {
+        n -= 1 << (2 * ptrshift);
+        // As in bmap(), skipped from 8K blocks on.
+        if (3 * ptrshift < 32 && n >> (3 * ptrshift) != 0) {
+            return -1;
+        }
+        levels = 3;
+        *top = &inode->blocktptr;
+    }
+
+    for (int l = 0; l < levels; l++) {
+        idx[l] = (n >> ((levels - 1 - l) * ptrshift)) & ptrmask;
+    }
+    return levels;
+}
+
+// Allocates a zeroed indirect block at `*goal` onwards.
+static u32 newindirect(ext2_incore *ip, u32 *goal)
+{
+    ext2fs *fs = ip->fs;
+    u32 got;
+    u32 blk = ext2_iballoc(ip, *goal, 1, &got);
+    if (!blk) {
+        printf("Error: ext2: No free blocks\n");
+        return 0;
+    }
+    buffer *bp = bget(fs->dev, blk, fs->blksize);
+    if (!bp) {
+        ext2_bfree(fs, blk, 1);
+        return 0;
+    }
+    memset(bp->data, 0, fs->blksize);
+    bdirty(bp);
+    brelse(bp);
+
+    ip->inode.sectors += fs->blksize / 512;
+    *goal = blk + 1;
+    return blk;
+}
+
+bool ext2_setmap(ext2_incore *ip, u32 lblk, u32 pblk, u32 *goal)
+{
+    ext2fs *fs = ip->fs;
+    u32 *top;
+    u32 idx[3];
+    int levels = path(fs, &ip->inode, lblk, &top, idx);
+    if (levels < 0) {
+        return false;
+    }
+    ext2_idirty(ip);
+    if (levels == 0) {
+        *top = pblk;
+        return true;
+    }
+
+    if (!*top) {
+        if (!(*top = newindirect(ip, goal))) {
+            return false;
+        }
+        // Cached leaves may be ones that were missing.
+        ip->bmap = (ext2_bmapcache) { 0 };
+    }
+
+    u32 blk = *top;
+    for (int l = 0; l < levels; l++) {
+        buffer *bp = ext2_bread(fs, blk);
+        if (!bp) {
+            return false;
+        }
+        u8 *ptr = (u8*)&bp->data[idx[l] * 4];
+        if (l == levels - 1) {
+            putle32(ptr, pblk);
+            bdirty(bp);
+        } else if (!(blk = getle32(ptr))) {
+            if (!(blk = newindirect(ip, goal))) {
+                brelse(bp);
+                return false;
+            }
+            putle32(ptr, blk);
+            bdirty(bp);
+            ip->bmap = (ext2_bmapcache) { 0 };
+        }
+        brelse(bp);
+    }
+    return true;
+}
+
+u32 ext2_mapdepth(ext2fs *fs, u32 lblk)
+{
+    // Only where the pointer is matters, not what the inode points to.
+    ext2_inode none;
+    u32 *top;
+    u32 idx[3];
+    int levels = path(fs, &none, lblk, &top, idx);
+    return levels > 0 ? levels : 0;
+}
+
+u32 ext2_leafend(ext2fs *fs, u32 lblk)
+{
+    // The leaves of all levels map blocks aligned to their size relative to
+    // the first indirect one.
+    if (lblk < NDIRECT) {
+        return NDIRECT;
+    }
+    u32 ptrmask = (1 << (fs->blkshift - 2)) - 1;
+    return NDIRECT + ((lblk - NDIRECT) | ptrmask) + 1;
+}
+
+// Frees the blocks under `*ptr`, which is `level` indirect blocks above the
+// data (0 for a data block) and maps logical blocks from `base` on, from
+// logical block `keep` on. Clears `*ptr` if nothing under it is kept.
+static void prune(ext2_incore *ip, u32 *ptr, unsigned level, u64 base,
+        u32 keep)
+{
+    ext2fs *fs = ip->fs;
+    unsigned ptrshift = fs->blkshift - 2;
+    u64 span = (u64)1 << (level * ptrshift);
+    if (!*ptr || base + span <= keep) {
+        return;
+    }
+
+    if (level > 0) {
+        buffer *bp = ext2_bread(fs, *ptr);
+        if (!bp) {
+            return;
+        }
+        bool empty = true;
+        for (u32 i = 0; i < 1u << ptrshift; i++) {
+            u8 *slot = (u8*)&bp->data[i * 4];
+            u32 child = getle32(slot);
+            if (child) {
+                prune(ip, &child, level - 1, base + (i * (span >> ptrshift)),
+                        keep);
+                if (!child) {
+                    putle32(slot, 0);
+                    bdirty(bp);
+                }
+            }
+            empty &= !child;
+        }
+        brelse(bp);
+        if (!empty) {
+            return;
+        }
+    }
+
+    ext2_bfree(fs, *ptr, 1);
+    ip->inode.sectors -= fs->blksize / 512;
+    *ptr = 0;
+}
+
+void ext2_itrunc(ext2_incore *ip, u32 keep)
+{
+    ext2_inode *inode = &ip->inode;
+    unsigned ptrshift = ip->fs->blkshift - 2;
+    for (u32 i = keep; i < NDIRECT; i++) {
+        prune(ip, &inode->blocks[i], 0, i, keep);
+    }
+    u64 base = NDIRECT;
+    prune(ip, &inode->blockptr, 1, base, keep);
+    base += (u64)1 << ptrshift;
+    prune(ip, &inode->blockdptr, 2, base, keep);
+    base += (u64)1 << (2 * ptrshift);
+    prune(ip, &inode->blocktptr, 3, base, keep);
+
+    ext2_idiscard(ip);
+    ip->bmap = (ext2_bmapcache) { 0 };
+    ext2_idirty(ip);
+}
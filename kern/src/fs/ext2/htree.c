@@ -0,0 +1,358 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/htree.c
+ * Hashed B-tree directory index (dir_index)
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../bio.h"
+#include "../../kernel.h"
+
+// Directories with an index still look like normal directories to old code:
+// the index lives in the blocks of the directory, hidden behind empty
+// directory entries. Block 0 holds the root of the tree:
+//   0: "." entry (12 bytes)
+//  12: ".." entry, spanning the rest of the block
+//  24: root info (8 bytes), see below
+//  32: index entries
+// Interior nodes hold an empty entry spanning the whole block, followed by
+// index entries at offset 8. Index entries are (hash, block) pairs sorted by
+// hash, except for the first one, whose hash is replaced by the maximum and
+// actual number of entries (`limit`, `count`). Entry n covers the names
+// hashing to at least its hash, up to the hash of entry n + 1. Leaves are
+// normal directory blocks.
+#define ROOT_INFO 24
+#define NODE_ENTRIES 8
+
+// Hash versions. The unsigned variants are the same as the signed ones,
+// except that they treat name bytes as unsigned chars. Which one a filesystem
+// uses depends on the platform that created it and is stored in the
+// superblock flags.
+#define HASH_LEGACY 0
+#define HASH_HALF_MD4 1
+#define HASH_TEA 2
+#define HASH_UNSIGNED 3
+
+// The hash of a name continued in the next leaf has its lowest bit set.
+#define HASH_CONTINUED 1
+
+// The tree is at most this deep (root + 2 levels with the largedir feature).
+#define MAXLEVELS 3
+
+static u32 rol32(u32 x, unsigned s)
+{
+    return (x << s) | (x >> (32 - s));
+}
+
+static u32 legacy(const char *name, u32 len, bool unsign)
+{
+    u32 hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    for (u32 i = 0; i < len; i++) {
+        int ch = unsign ? (int)(u8)name[i] : (int)(s8)name[i];
+        u32 hash = hash1 + (hash0 ^ ((u32)ch * 7152373));
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Packs up to `num` * 4 bytes of a name into `num` words, padded with a
+// pattern made from the name's length.
+static void packname(const char *name, u32 len, u32 *buf, int num,
+        bool unsign)
+{
+    u32 pad = len | (len << 8);
+    pad |= pad << 16;
+    u32 val = pad;
+
+    if (len > (u32)num * 4) {
+        len = num * 4;
+    }
+    for (u32 i = 0; i < len; i++) {
+        int ch = unsign ? (int)(u8)name[i] : (int)(s8)name[i];
+        val = (u32)ch + (val << 8);
+        if (i % 4 == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define K2 013240474631u
+#define K3 015666365641u
+
+// The first three rounds of MD4, over 32 bytes of input.
+static void halfmd4(u32 buf[4], const u32 in[8])
+{
+    u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0], 3);
+    ROUND(F, d, a, b, c, in[1], 7);
+    ROUND(F, c, d, a, b, in[2], 11);
+    ROUND(F, b, c, d, a, in[3], 19);
+    ROUND(F, a, b, c, d, in[4], 3);
+    ROUND(F, d, a, b, c, in[5], 7);
+    ROUND(F, c, d, a, b, in[6], 11);
+    ROUND(F, b, c, d, a, in[7], 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// 16 rounds of the Tiny Encryption Algorithm, over 16 bytes of input.
+static void tea(u32 buf[4], const u32 in[4])
+{
+    u32 sum = 0;
+    u32 b0 = buf[0], b1 = buf[1];
+    u32 a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+u32 ext2_dxhash(ext2fs *fs, unsigned version, const char *name, u32 len)
+{
+    bool unsign = version >= HASH_UNSIGNED;
+    if (unsign) {
+        version -= HASH_UNSIGNED;
+    }
+
+    // The MD4 initial values, unless the filesystem has a seed.
+    u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    const u32 *seed = fs->sblock.hashseed;
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        for (int i = 0; i < 4; i++) {
+            buf[i] = seed[i];
+        }
+    }
+
+    u32 hash, in[8];
+    switch (version) {
+        case HASH_HALF_MD4:
+            for (u32 i = 0; i < len; i += 32) {
+                packname(&name[i], len - i, in, 8, unsign);
+                halfmd4(buf, in);
+            }
+            hash = buf[1];
+            break;
+
+        case HASH_TEA:
+            for (u32 i = 0; i < len; i += 16) {
+                packname(&name[i], len - i, in, 4, unsign);
+                tea(buf, in);
+            }
+            hash = buf[0];
+            break;
+
+        default:
+            hash = legacy(name, len, unsign);
+    }
+
+    // The lowest bit is used to mark continued hashes, and the largest hash
+    // value is reserved as an end marker.
+    hash &= ~HASH_CONTINUED;
+    if (hash == 0x7fffffffu << 1) {
+        hash = 0x7ffffffeu << 1;
+    }
+    return hash;
+}
+
+// A position in an index node.
+typedef struct {
+    buffer *bp;         // Block holding the node.
+    const u8 *entries;
+    u32 count;
+    u32 at;
+} frame;
+
+// Reads logical block `lblk` of directory `dir`.
+static buffer *dirblock(ext2_incore *dir, u32 lblk)
+{
+    u32 pblk = ext2_ibmap(dir, lblk);
+    if (pblk == 0) {
+        return 0;
+    }
+    return ext2_bread(dir->fs, pblk);
+}
+
+// Releases the blocks of frames `from` to `to`.
+static void leave(frame *frames, int from, int to)
+{
+    for (int l = from; l <= to; l++) {
+        brelse(frames[l].bp);
+    }
+}
+
+static u32 entryhash(const frame *f)
+{
+    return getle32(&f->entries[f->at * 8]);
+}
+
+static u32 entryblock(const frame *f)
+{
+    return getle32(&f->entries[f->at * 8 + 4]) & 0x0fffffff;
+}
+
+// Sets up `f` for the index node at `off` in block `bp`, positioned at the
+// last entry with a hash not larger than `hash`. The frame takes over the
+// reference to `bp`, which is released if the node is bad.
+static bool enter(frame *f, buffer *bp, u32 off, u32 hash)
+{
+    if (!bp) {
+        return false;
+    }
+    const u8 *entries = (const u8*)&bp->data[off];
+    u32 limit = getle16(&entries[0]);
+    u32 count = getle16(&entries[2]);
+    if (count == 0 || count > limit ||
+            off + limit * 8 > bp->size) {
+        brelse(bp);
+        return false;
+    }
+
+    // Binary search over entries 1 to count - 1; entry 0 has no hash.
+    u32 lo = 1, hi = count;
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        if (getle32(&entries[mid * 8]) <= hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    f->bp = bp;
+    f->entries = entries;
+    f->count = count;
+    f->at = lo - 1;
+    return true;
+}
+
+bool ext2_dxlookup(ext2_incore *dir, const char *name, u32 len, u32 *ino)
+{
+    ext2fs *fs = dir->fs;
+    if (!(fs->sblock.optfeatures & EXT2_FEATURE_DIR_INDEX) ||
+            !(dir->inode.flags & EXT2_INDEX_FL)) {
+        return false;
+    }
+
+    // Anything we don't understand about the index, we leave to the linear
+    // scan, which works on any directory.
+    buffer *root = dirblock(dir, 0);
+    if (!root) {
+        return false;
+    }
+    const u8 *info = (const u8*)&root->data[ROOT_INFO];
+    unsigned version = info[4];
+    unsigned infolen = info[5];
+    unsigned levels = info[6];
+    if (getle32(info) != 0 || version > HASH_TEA || infolen != 8 ||
+            levels >= MAXLEVELS) {
+        brelse(root);
+        return false;
+    }
+    if (fs->sblock.flags & EXT2_FLAGS_UNSIGNED_HASH) {
+        version += HASH_UNSIGNED;
+    }
+
+    u32 hash = ext2_dxhash(fs, version, name, len);
+
+    // Walk down the tree to the leaf which would hold the name.
+    frame frames[MAXLEVELS];
+    if (!enter(&frames[0], root, ROOT_INFO + infolen, hash)) {
+        return false;
+    }
+    for (unsigned l = 1; l <= levels; l++) {
+        buffer *node = dirblock(dir, entryblock(&frames[l - 1]));
+        if (!enter(&frames[l], node, NODE_ENTRIES, hash)) {
+            leave(frames, 0, l - 1);
+            return false;
+        }
+    }
+
+    while (true) {
+        // A leaf we can't read is left to the linear scan to report.
+        if (!ext2_dirsearch(dir, entryblock(&frames[levels]), name, len,
+                ino)) {
+            leave(frames, 0, levels);
+            return false;
+        }
+        if (*ino) {
+            break;
+        }
+
+        // Names with the same hash may continue in the next leaf, whose
+        // hash then has the continuation bit set. Find the next entry,
+        // moving up the tree as long as nodes are exhausted...
+        int l = levels;
+        while (l >= 0 && frames[l].at + 1 >= frames[l].count) {
+            l--;
+        }
+        if (l < 0) {
+            break;
+        }
+        frames[l].at++;
+        if ((entryhash(&frames[l]) & ~HASH_CONTINUED) != hash) {
+            break;
+        }
+
+        // ...and back down to the leftmost leaf below it.
+        for (l++; l <= (int)levels; l++) {
+            brelse(frames[l].bp);
+            buffer *node = dirblock(dir, entryblock(&frames[l - 1]));
+            if (!enter(&frames[l], node, NODE_ENTRIES, 0)) {
+                leave(frames, 0, l - 1);
+                leave(frames, l + 1, levels);
+                return false;
+            }
+        }
+    }
+
+    leave(frames, 0, levels);
+    return true;
+}
@@ -0,0 +1,193 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/icache.c
+ * In-core inode cache
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../kernel.h"
+
+// Number of hash buckets. Must be a power of two.
+#define NHASH 64
+
+// The inode table. Entries are found through a hash of (fs, ino). Entries
+// nobody holds a reference to are kept on an LRU list, with free entries and
+// the least recently released ones first, so a miss reuses the head. Changed
+// inodes (and their delayed blocks) are written back when they leave the
+// table.
+static ext2_incore table[EXT2_NINODE];
+static ext2_incore *hash[NHASH];
+static ext2_incore lru = { .lprev = &lru, .lnext = &lru };
+static bool initialized;
+
+static ext2_icache_stats stats;
+
+static unsigned hashof(ext2fs *fs, u32 ino)
+{
+    return (ino ^ ((uintptr_t)fs >> 4)) & (NHASH - 1);
+}
+
+static void lru_remove(ext2_incore *ip)
+{
+    ip->lprev->lnext = ip->lnext;
+    ip->lnext->lprev = ip->lprev;
+}
+
+static void lru_append(ext2_incore *ip)
+{
+    ip->lprev = lru.lprev;
+    ip->lnext = &lru;
+    lru.lprev->lnext = ip;
+    lru.lprev = ip;
+}
+
+static void lru_prepend(ext2_incore *ip)
+{
+    ip->lprev = &lru;
+    ip->lnext = lru.lnext;
+    lru.lnext->lprev = ip;
+    lru.lnext = ip;
+}
+
+static void hash_remove(ext2_incore *ip)
+{
+    ext2_incore **pp = &hash[hashof(ip->fs, ip->ino)];
+    while (*pp != ip) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = ip->hnext;
+}
+
+static bool writeback(ext2_incore *ip)
+{
+    if (ip->ndelay) {
+        ext2_iflushdelayed(ip);
+    }
+    ext2_idiscard(ip);
+    if (!ip->dirty) {
+        return true;
+    }
+    if (!ext2_writeinode(ip->fs, &ip->inode, ip->ino)) {
+        printf("Error: ext2: Can't write inode %u\n", ip->ino);
+        return false;
+    }
+    ip->dirty = false;
+    return true;
+}
+
+static void init(void)
+{
+    for (unsigned i = 0; i < EXT2_NINODE; i++) {
+        lru_append(&table[i]);
+    }
+    initialized = true;
+}
+
+ext2_incore *ext2_iget(ext2fs *fs, u32 ino)
+{
+    if (!initialized) {
+        init();
+    }
+
+    unsigned h = hashof(fs, ino);
+    for (ext2_incore *ip = hash[h]; ip; ip = ip->hnext) {
+        if (ip->fs == fs && ip->ino == ino) {
+            if (ip->refs++ == 0) {
+                lru_remove(ip);
+            }
+            stats.hits++;
+            return ip;
+        }
+    }
+
+    stats.misses++;
+
+    // Reuse the least recently used unreferenced entry.
+    ext2_incore *ip = lru.lnext;
+    if (ip == &lru) {
+        printf("Error: ext2: inode table overflow\n");
+        return 0;
+    }
+    if (ip->fs) {
+        writeback(ip);
+        hash_remove(ip);
+        ip->fs = 0;
+        stats.evictions++;
+    }
+
+    if (!ext2_readinode(fs, &ip->inode, ino)) {
+        return 0;
+    }
+
+    // Forget the block map of the previous inode.
+    ip->bmap = (ext2_bmapcache) { 0 };
+    ip->dirty = false;
+    ip->orphan = false;
+    ip->ndelay = 0;
+    ip->nprealloc = 0;
+
+    lru_remove(ip);
+    ip->fs = fs;
+    ip->ino = ino;
+    ip->refs = 1;
+    ip->hnext = hash[h];
+    hash[h] = ip;
+    return ip;
+}
+
+void ext2_iput(ext2_incore *ip)
+{
+    //assert(ip->refs > 0)
+    if (ip->refs == 1 && ip->orphan) {
+        ext2_idelete(ip);
+    }
+    if (--ip->refs == 0) {
+        ext2_idiscard(ip);
+        lru_append(ip);
+    }
+}
+
+void ext2_idirty(ext2_incore *ip)
+{
+    ip->dirty = true;
+    ext2_touch(ip->fs);
+}
+
+bool ext2_isync(ext2fs *fs)
+{
+    bool ok = true;
+    for (unsigned i = 0; i < EXT2_NINODE; i++) {
+        if (table[i].fs == fs) {
+            ok &= writeback(&table[i]);
+        }
+    }
+    return ok;
+}
+
+void ext2_iflush(ext2fs *fs)
+{
+    if (!initialized) {
+        return;
+    }
+
+    for (unsigned i = 0; i < EXT2_NINODE; i++) {
+        ext2_incore *ip = &table[i];
+        if (ip->fs == fs && ip->refs == 0) {
+            writeback(ip);
+            hash_remove(ip);
+            ip->fs = 0;
+            lru_remove(ip);
+            lru_prepend(ip);
+        }
+    }
+}
+
+void ext2_icachestats(ext2_icache_stats *out)
+{
+    *out = stats;
+}
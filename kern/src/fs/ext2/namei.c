@@ -0,0 +1,297 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/namei.c
+ * Path name lookup and directory entry cache
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../kernel.h"
+#include "../../mem.h"
+
+// Number of hash buckets. Must be a power of two.
+#define NHASH 64
+
+// A cached directory entry. Entries with `ino` 0 are negative: they remember
+// that `name` does not exist in `parent`, so that failing lookups don't scan
+// the directory either.
+typedef struct dentry {
+    ext2fs *fs;         // Filesystem, 0 if the entry is free.
+    u32 parent;         // Inode number of the directory.
+    u32 hash;           // Hash of the name.
+    u32 ino;
+    u8 len;
+    char name[EXT2_DNAME_MAX];
+
+    struct dentry *hnext;   // Next entry in the same hash bucket.
+    struct dentry *lprev;   // LRU list of all entries, free ones first.
+    struct dentry *lnext;
+} dentry;
+
+static dentry table[EXT2_NDENTRY];
+static dentry *hash[NHASH];
+static dentry lru = { .lprev = &lru, .lnext = &lru };
+static bool initialized;
+
+static ext2_dcache_stats stats;
+
+// FNV-1a.
+static u32 hashname(const char *name, u32 len)
+{
+    u32 h = 2166136261u;
+    for (u32 i = 0; i < len; i++) {
+        h = (h ^ (u8)name[i]) * 16777619;
+    }
+    return h;
+}
+
+static unsigned bucket(ext2fs *fs, u32 parent, u32 h)
+{
+    return (h ^ parent ^ ((uintptr_t)fs >> 4)) & (NHASH - 1);
+}
+
+static void lru_remove(dentry *dp)
+{
+    dp->lprev->lnext = dp->lnext;
+    dp->lnext->lprev = dp->lprev;
+}
+
+static void lru_append(dentry *dp)
+{
+    dp->lprev = lru.lprev;
+    dp->lnext = &lru;
+    lru.lprev->lnext = dp;
+    lru.lprev = dp;
+}
+
+static void lru_prepend(dentry *dp)
+{
+    dp->lprev = &lru;
+    dp->lnext = lru.lnext;
+    lru.lnext->lprev = dp;
+    lru.lnext = dp;
+}
+
+static void hash_remove(dentry *dp)
+{
+    dentry **pp = &hash[bucket(dp->fs, dp->parent, dp->hash)];
+    while (*pp != dp) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = dp->hnext;
+}
+
+static void init(void)
+{
+    for (unsigned i = 0; i < EXT2_NDENTRY; i++) {
+        lru_append(&table[i]);
+    }
+    initialized = true;
+}
+
+static dentry *dcache_find(ext2fs *fs, u32 parent, const char *name, u32 len,
+        u32 h)
+{
+    for (dentry *dp = hash[bucket(fs, parent, h)]; dp; dp = dp->hnext) {
+        if (dp->fs == fs && dp->parent == parent && dp->hash == h &&
+                dp->len == len && !memcmp(dp->name, name, len)) {
+            return dp;
+        }
+    }
+    return 0;
+}
+
+static void dcache_add(ext2fs *fs, u32 parent, const char *name, u32 len,
+        u32 h, u32 ino)
+{
+    if (len > EXT2_DNAME_MAX) {
+        return;
+    }
+
+    // Reuse the least recently used entry.
+    dentry *dp = lru.lnext;
+    if (dp->fs) {
+        hash_remove(dp);
+    }
+    lru_remove(dp);
+    lru_append(dp);
+
+    dp->fs = fs;
+    dp->parent = parent;
+    dp->hash = h;
+    dp->ino = ino;
+    dp->len = len;
+    memcpy(dp->name, name, len);
+
+    unsigned b = bucket(fs, parent, h);
+    dp->hnext = hash[b];
+    hash[b] = dp;
+}
+
+bool ext2_dirsearch(ext2_incore *dir, u32 lblk, const char *name, u32 len,
+        u32 *ino)
+{
+    ext2fs *fs = dir->fs;
+    union {
+        ext2_dir_entry e;
+        char raw[sizeof(ext2_dir_entry) + EXT2_NAME_MAX];
+    } buf;
+
+    *ino = 0;
+    u32 pblk = ext2_ibmap(dir, lblk);
+    if (pblk == 0) {
+        return true;    // Holes in directories have no entries.
+    }
+
+    buffer *bp = ext2_bread(fs, pblk);
+    if (!bp) {
+        return false;
+    }
+
+    const char *block = bp->data;
+    bool ok = true;
+    u32 off = 0;
+    while (off + sizeof(ext2_dir_entry) <= fs->blksize) {
+        const ext2_dir_entry *ep = ext2_getdirent(fs, &buf.e, &block[off],
+                fs->blksize - off);
+        if (!ep || ep->reclen < sizeof(ext2_dir_entry) + ep->namelen ||
+                ep->reclen > fs->blksize - off) {
+            printf("Error: ext2: Bad directory entry in inode %u\n",
+                    dir->ino);
+            ok = false;
+            break;
+        }
+        if (ep->ino && ep->namelen == len && !memcmp(ep->name, name, len)) {
+            *ino = ep->ino;
+            break;
+        }
+        off += ep->reclen;
+    }
+
+    brelse(bp);
+    return ok;
+}
+
+// Scans all blocks of directory `dir` for `name`.
+static bool scandir(ext2_incore *dir, const char *name, u32 len, u32 *ino)
+{
+    if (ext2_dxlookup(dir, name, len, ino)) {
+        return true;
+    }
+
+    *ino = 0;
+    u32 nblocks = (dir->inode.size_lo + dir->fs->blksize - 1) >>
+            dir->fs->blkshift;
+    for (u32 lblk = 0; lblk < nblocks; lblk++) {
+        if (!ext2_dirsearch(dir, lblk, name, len, ino)) {
+            return false;
+        }
+        if (*ino) {
+            return true;
+        }
+    }
+    return true;
+}
+
+bool ext2_lookup(ext2_incore *dir, const char *name, u32 len, u32 *ino)
+{
+    if (!initialized) {
+        init();
+    }
+
+    u32 h = hashname(name, len);
+    dentry *dp = dcache_find(dir->fs, dir->ino, name, len, h);
+    if (dp) {
+        stats.hits++;
+        if (!dp->ino) {
+            stats.neghits++;
+        }
+        lru_remove(dp);
+        lru_append(dp);
+        *ino = dp->ino;
+        return true;
+    }
+
+    // Only a directory we could read all of tells that a name is missing.
+    stats.misses++;
+    if (!scandir(dir, name, len, ino)) {
+        return false;
+    }
+    dcache_add(dir->fs, dir->ino, name, len, h, *ino);
+    return true;
+}
+
+ext2_incore *ext2_namei(ext2fs *fs, const char *path)
+{
+    ext2_incore *ip = ext2_iget(fs, EXT2_ROOT_INO);
+
+    while (ip) {
+        // Get the next path component.
+        while (*path == '/') {
+            path++;
+        }
+        if (!*path) {
+            break;
+        }
+        const char *name = path;
+        while (*path && *path != '/') {
+            path++;
+        }
+        u32 len = path - name;
+
+        // FIXME: Follow symbolic links.
+        if ((ip->inode.mode & EXT2_S_IFMT) != EXT2_S_IFDIR ||
+                len > EXT2_NAME_MAX) {
+            ext2_iput(ip);
+            return 0;
+        }
+
+        u32 ino;
+        bool found = ext2_lookup(ip, name, len, &ino) && ino;
+        ext2_iput(ip);
+        ip = found ? ext2_iget(fs, ino) : 0;
+    }
+
+    return ip;
+}
+
+void ext2_dset(ext2fs *fs, u32 parent, const char *name, u32 len, u32 ino)
+{
+    if (!initialized) {
+        init();
+    }
+
+    u32 h = hashname(name, len);
+    dentry *dp = dcache_find(fs, parent, name, len, h);
+    if (dp) {
+        dp->ino = ino;
+    } else {
+        dcache_add(fs, parent, name, len, h, ino);
+    }
+}
+
+void ext2_dflush(ext2fs *fs)
+{
+    if (!initialized) {
+        return;
+    }
+
+    for (unsigned i = 0; i < EXT2_NDENTRY; i++) {
+        dentry *dp = &table[i];
+        if (dp->fs == fs) {
+            hash_remove(dp);
+            dp->fs = 0;
+            lru_remove(dp);
+            lru_prepend(dp);
+        }
+    }
+}
+
+void ext2_dcachestats(ext2_dcache_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,124 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/readahead.c
+ * Open files and sequential readahead
+ * 
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../kernel.h"
+
+static ext2_ra_stats stats;
+
+bool ext2_fopen(ext2_file *f, ext2_incore *ip)
+{
+    // Another reference to the same inode is always a cache hit.
+    if (!ext2_iget(ip->fs, ip->ino)) {
+        return false;
+    }
+    *f = (ext2_file) {
+        .ip = ip,
+    };
+    return true;
+}
+
+void ext2_fclose(ext2_file *f)
+{
+    stats.wasted += f->ra.end - f->ra.start;
+    ext2_iput(f->ip);
+    f->ip = 0;
+}
+
+void ext2_fseek(ext2_file *f, u32 pos)
+{
+    // The readahead state is left alone: the next read tells whether the
+    // reader has actually moved.
+    f->pos = pos;
+}
+
+// Called before reading blocks `first` to `last`. A read that starts where
+// the previous one stopped (or in the block it stopped in, for reads that
+// aren't block aligned) is sequential, and doubles the window; any other read
+// halves it and drops what was fetched ahead. Sequential reads then top up
+// the blocks fetched ahead of `last` to the window.
+static void readahead(ext2_file *f, u32 first, u32 last)
+{
+    ext2_readahead *ra = &f->ra;
+    ext2_incore *ip = f->ip;
+    ext2fs *fs = ip->fs;
+
+    bool sequential = first == ra->next || first + 1 == ra->next;
+    ra->next = last + 1;
+
+    if (!sequential) {
+        stats.wasted += ra->end - ra->start;
+        ra->start = ra->end = 0;
+        if (ra->window) {
+            ra->window /= 2;
+            stats.shrinks++;
+        }
+        return;
+    }
+
+    if (first < ra->end && last >= ra->start) {
+        u32 from = first > ra->start ? first : ra->start;
+        u32 to = last < ra->end ? last + 1 : ra->end;
+        stats.hits += to - from;
+    }
+    if (ra->start < last + 1) {
+        ra->start = last + 1;
+    }
+    if (ra->end < ra->start) {
+        ra->end = ra->start;
+    }
+
+    if (ra->window < EXT2_RAMAX) {
+        ra->window = ra->window ? ra->window * 2 : EXT2_RAMIN;
+        if (ra->window > EXT2_RAMAX) {
+            ra->window = EXT2_RAMAX;
+        }
+        stats.grows++;
+    }
+
+    u32 nblocks = (ip->inode.size_lo + fs->blksize - 1) >> fs->blkshift;
+    u32 until = last + 1 + ra->window;
+    if (until > nblocks) {
+        until = nblocks;
+    }
+    for (; ra->end < until; ra->end++) {
+        u32 pblk = ext2_ibmap(ip, ra->end);
+        // Holes need no fetching, but count as fetched all the same.
+        if (pblk) {
+            bprefetch(fs->dev, pblk, fs->blksize);
+        }
+        stats.issued++;
+    }
+}
+
+u32 ext2_fread(ext2_file *f, void *buf, u32 len)
+{
+    ext2_incore *ip = f->ip;
+    ext2fs *fs = ip->fs;
+    u32 size = ip->inode.size_lo;
+    if (f->pos >= size || len == 0) {
+        return 0;
+    }
+    if (len > size - f->pos) {
+        len = size - f->pos;
+    }
+
+    readahead(f, f->pos >> fs->blkshift, (f->pos + len - 1) >> fs->blkshift);
+
+    u32 done = ext2_iread(ip, f->pos, buf, len);
+    f->pos += done;
+    return done;
+}
+
+void ext2_rastats(ext2_ra_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,545 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * fs/ext2/write.c
+ * Writing files and directories, with delayed allocation
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "ext2.h"
+
+#include "../../bio.h"
+#include "../../kernel.h"
+#include "../../mem.h"
+
+// Data written to blocks a file doesn't have yet is kept in a table of
+// delayed blocks, rather than given blocks on disk right away. Blocks are
+// only allocated when the table is flushed, for all delayed blocks of a file
+// at once and in file order, so a file written in small pieces (or alongside
+// other files) still gets its blocks in a row. Writes to blocks the file
+// already has go to the buffer cache. Each delayed block has the free
+// blocks it may need reserved, for itself and the indirect blocks above it,
+// so that it surely finds a place when it is flushed. Writes are cut short
+// when nothing more can be reserved.
+//
+// All other changes are made in memory too: inodes in the inode cache,
+// directories and bitmaps in the buffer cache and free counts in the in-core
+// groups. ext2_sync() flushes the delayed blocks, stores the changed inodes
+// and the group and superblock counts of all changes since the last sync at
+// once, and writes everything out. From the first change after a sync until
+// the next one is done, the superblock on disk says the filesystem was not
+// unmounted cleanly, so that fsck checks it after a crash.
+//
+// We have no clock, so times are left alone.
+
+typedef struct {
+    ext2_incore *ip;    // File, 0 if the slot is free.
+    u32 lblk;
+    u32 resv;           // Free blocks reserved for it.
+    char data[BUF_MAXSIZE];
+} delayed;
+
+static delayed slots[EXT2_NDELAY];
+
+static ext2_write_stats stats;
+
+// Largest file size. Sizes are only written to the lower 32 bits, and
+// without the large_file feature need to fit into 31 bits.
+static u32 maxsize(ext2fs *fs)
+{
+    return fs->sblock.rwreqfeatures & EXT2_FEATURE_LARGE_FILE ?
+            0xffffffff : 0x7fffffff;
+}
+
+static delayed *finddelayed(ext2_incore *ip, u32 lblk)
+{
+    if (!ip->ndelay) {
+        return 0;
+    }
+    for (unsigned i = 0; i < EXT2_NDELAY; i++) {
+        if (slots[i].ip == ip && slots[i].lblk == lblk) {
+            return &slots[i];
+        }
+    }
+    return 0;
+}
+
+const char *ext2_delayed(ext2_incore *ip, u32 lblk)
+{
+    delayed *d = finddelayed(ip, lblk);
+    return d ? d->data : 0;
+}
+
+static void freeslot(delayed *d)
+{
+    ext2_bunreserve(d->ip->fs, d->resv);
+    d->resv = 0;
+    d->ip->ndelay--;
+    d->ip = 0;
+}
+
+static void dropdelayed(ext2_incore *ip, u32 from)
+{
+    for (unsigned i = 0; i < EXT2_NDELAY && ip->ndelay; i++) {
+        if (slots[i].ip == ip && slots[i].lblk >= from) {
+            freeslot(&slots[i]);
+        }
+    }
+}
+
+// Where to allocate block `lblk` of a file: after the block before it, or
+// failing that, at the start of the inode's group.
+static u32 goalfor(ext2_incore *ip, u32 lblk)
+{
+    ext2fs *fs = ip->fs;
+    u32 prev = lblk ? ext2_ibmap(ip, lblk - 1) : 0;
+    if (prev) {
+        return prev + 1;
+    }
+    u32 g = (ip->ino - 1) / fs->sblock.grpinodes;
+    return fs->sblock.sblockno + g * fs->sblock.grpblocks;
+}
+
+bool ext2_iflushdelayed(ext2_incore *ip)
+{
+    ext2fs *fs = ip->fs;
+
+    // The file's delayed blocks, in file order.
+    delayed *list[EXT2_NDELAY];
+    u32 n = 0;
+    for (unsigned i = 0; i < EXT2_NDELAY; i++) {
+        if (slots[i].ip != ip) {
+            continue;
+        }
+        u32 j = n++;
+        while (j > 0 && list[j - 1]->lblk > slots[i].lblk) {
+            list[j] = list[j - 1];
+            j--;
+        }
+        list[j] = &slots[i];
+    }
+
+    // What was reserved for them is what they are allocated now.
+    for (u32 i = 0; i < n; i++) {
+        ext2_bunreserve(fs, list[i]->resv);
+        list[i]->resv = 0;
+    }
+
+    bool ok = true;
+    u32 goal = n ? goalfor(ip, list[0]->lblk) : 0;
+    u32 pending = 0;
+    u32 i = 0;
+    while (i < n) {
+        // Blocks in a row in the file, as far as their pointers are in the
+        // same block. Missing indirect blocks for them go first, so that
+        // they don't break up the run.
+        u32 lblk = list[i]->lblk;
+        u32 end = ext2_leafend(fs, lblk);
+        u32 want = 1;
+        while (i + want < n && list[i + want]->lblk == lblk + want &&
+                lblk + want < end) {
+            want++;
+        }
+        if (!ext2_setmap(ip, lblk, 0, &goal)) {
+            ok = false;
+            break;
+        }
+
+        u32 got;
+        u32 pblk = ext2_iballoc(ip, goal, want, &got);
+        if (!pblk) {
+            printf("Error: ext2: No free blocks\n");
+            ok = false;
+            break;
+        }
+        stats.runs++;
+        stats.flushed += got;
+        ip->inode.sectors += got * (fs->blksize / 512);
+
+        for (u32 k = 0; k < got; k++, i++) {
+            delayed *d = list[i];
+            buffer *bp = 0;
+            if (!ext2_setmap(ip, d->lblk, pblk + k, &goal)) {
+                ext2_bfree(fs, pblk + k, 1);
+                ip->inode.sectors -= fs->blksize / 512;
+                ok = false;
+            } else if ((bp = bget(fs->dev, pblk + k, fs->blksize))) {
+                memcpy(bp->data, d->data, fs->blksize);
+                bdirty(bp);
+                brelse(bp);
+            } else {
+                ok = false;
+            }
+            freeslot(d);
+        }
+        goal = pblk + got;
+
+        // Keep buffers free for the blocks still to come.
+        if ((pending += got) >= NBUF / 2) {
+            ok &= bsync(fs->dev);
+            pending = 0;
+        }
+    }
+
+    // Blocks that found no place are lost. With their blocks reserved, that
+    // takes a disk error or a corrupt filesystem, which fsck is left to.
+    while (i < n) {
+        freeslot(list[i++]);
+    }
+    if (!ok) {
+        fs->mountstate |= EXT2_ERROR_FS;
+    }
+    return ok;
+}
+
+// Flushes the delayed blocks of all files of `fs`, or of all filesystems if
+// `fs` is 0.
+static bool flushall(ext2fs *fs)
+{
+    bool ok = true;
+    for (unsigned i = 0; i < EXT2_NDELAY; i++) {
+        if (slots[i].ip && (!fs || slots[i].ip->fs == fs)) {
+            ok &= ext2_iflushdelayed(slots[i].ip);
+        }
+    }
+    return ok;
+}
+
+// Gets a free slot for block `lblk` of `ip`, with the blocks it may need
+// reserved. Flushes all delayed blocks if there is no slot or not enough
+// free blocks, which gives back what was reserved for indirect blocks that
+// turned out to be there already. Returns 0 if that doesn't help either.
+static delayed *newslot(ext2_incore *ip, u32 lblk)
+{
+    ext2fs *fs = ip->fs;
+    u32 resv = 1 + ext2_mapdepth(fs, lblk);
+    delayed *d = 0;
+    for (int pass = 0; pass < 2 && !d; pass++) {
+        if (pass && !flushall(0)) {
+            return 0;
+        }
+        if (!ext2_breserve(fs, resv)) {
+            continue;
+        }
+        for (unsigned i = 0; i < EXT2_NDELAY; i++) {
+            if (!slots[i].ip) {
+                d = &slots[i];
+                break;
+            }
+        }
+        if (!d) {
+            ext2_bunreserve(fs, resv);
+        }
+    }
+    if (!d) {
+        printf("Error: ext2: No free blocks\n");
+        return 0;
+    }
+
+    ip->ndelay++;
+    d->ip = ip;
+    d->lblk = lblk;
+    d->resv = resv;
+    stats.delayed++;
+    return d;
+}
+
+void ext2_touch(ext2fs *fs)
+{
+    if (fs->dirty) {
+        return;
+    }
+    fs->dirty = true;
+    fs->dirtied = ticks();
+    fs->sblock.fsstate &= ~EXT2_VALID_FS;
+    ext2_writesblock(fs);
+}
+
+// Syncs `fs` if its oldest change waited long enough. There is no thread to
+// do it in the background, so every change checks this, and changes after
+// the last one only reach the disk with the next ext2_sync().
+static void maybesync(ext2fs *fs)
+{
+    if (fs->dirty && ticks() - fs->dirtied >= EXT2_SYNC_INTERVAL) {
+        ext2_sync(fs);
+    }
+}
+
+bool ext2_sync(ext2fs *fs)
+{
+    if (!fs->dirty) {
+        return true;
+    }
+
+    bool ok = flushall(fs);
+    ok &= ext2_isync(fs);
+
+    u32 freeblocks = 0;
+    u32 freeinodes = 0;
+    for (u32 g = 0; g < fs->numgroups; g++) {
+        ext2_group *grp = &fs->groups[g];
+        if (grp->dirty) {
+            ok &= ext2_writebgd(fs, g);
+            grp->dirty = false;
+        }
+        freeblocks += grp->freeblocks;
+        freeinodes += grp->freeinodes;
+    }
+    fs->sblock.freeblocks = freeblocks;
+    fs->sblock.freeinodes = freeinodes;
+    ok &= bsync(fs->dev);
+
+    // The filesystem on disk is only back in its mount state (clean, unless
+    // it was mounted unclean) once everything else is there. Errors stay
+    // recorded for fsck.
+    if (!ok) {
+        fs->mountstate |= EXT2_ERROR_FS;
+    }
+    fs->sblock.fsstate = ok ? fs->mountstate :
+            fs->mountstate & ~EXT2_VALID_FS;
+    ok &= ext2_writesblock(fs);
+
+    stats.syncs++;
+    fs->dirty = !ok;
+    fs->dirtied = ticks();
+    return ok;
+}
+
+u32 ext2_write(ext2_incore *ip, u32 offset, const void *buf, u32 len)
+{
+    ext2fs *fs = ip->fs;
+    if (!fs->writable || (ip->inode.mode & EXT2_S_IFMT) != EXT2_S_IFREG ||
+            offset >= maxsize(fs)) {
+        return 0;
+    }
+    if (len > maxsize(fs) - offset) {
+        len = maxsize(fs) - offset;
+    }
+
+    const char *src = buf;
+    u32 done = 0;
+    while (done < len) {
+        u32 lblk = (offset + done) >> fs->blkshift;
+        u32 inblk = (offset + done) & (fs->blksize - 1);
+        u32 n = fs->blksize - inblk;
+        n = n < len - done ? n : len - done;
+
+        u32 pblk = ext2_ibmap(ip, lblk);
+        if (pblk) {
+            // Whole blocks are overwritten without reading them first.
+            buffer *bp = n == fs->blksize ?
+                    bget(fs->dev, pblk, fs->blksize) : ext2_bread(fs, pblk);
+            if (!bp) {
+                break;
+            }
+            memcpy(&bp->data[inblk], &src[done], n);
+            bdirty(bp);
+            brelse(bp);
+        } else {
+            delayed *d = finddelayed(ip, lblk);
+            if (!d) {
+                if (!(d = newslot(ip, lblk))) {
+                    break;
+                }
+                // New blocks, like holes, read as zeroes where not written.
+                if (n < fs->blksize) {
+                    memset(d->data, 0, fs->blksize);
+                }
+            }
+            memcpy(&d->data[inblk], &src[done], n);
+        }
+        done += n;
+    }
+
+    if (done) {
+        if (offset + done > ip->inode.size_lo) {
+            ip->inode.size_lo = offset + done;
+        }
+        ext2_idirty(ip);
+    }
+    maybesync(fs);
+    return done;
+}
+
+bool ext2_truncate(ext2_incore *ip, u32 size)
+{
+    ext2fs *fs = ip->fs;
+    if (!fs->writable || (ip->inode.mode & EXT2_S_IFMT) != EXT2_S_IFREG ||
+            size > maxsize(fs)) {
+        return false;
+    }
+
+    if (size < ip->inode.size_lo) {
+        u32 keep = ((u64)size + fs->blksize - 1) >> fs->blkshift;
+        dropdelayed(ip, keep);
+        ext2_itrunc(ip, keep);
+
+        // The rest of the last block has to read as zeroes if the file grows
+        // again.
+        u32 inblk = size & (fs->blksize - 1);
+        if (inblk) {
+            u32 lblk = size >> fs->blkshift;
+            u32 pblk = ext2_ibmap(ip, lblk);
+            delayed *d = pblk ? 0 : finddelayed(ip, lblk);
+            buffer *bp = pblk ? ext2_bread(fs, pblk) : 0;
+            if (d) {
+                memset(&d->data[inblk], 0, fs->blksize - inblk);
+            } else if (bp) {
+                memset(&bp->data[inblk], 0, fs->blksize - inblk);
+                bdirty(bp);
+            }
+            if (bp) {
+                brelse(bp);
+            }
+        }
+    }
+
+    ip->inode.size_lo = size;
+    ext2_idirty(ip);
+    maybesync(fs);
+    return true;
+}
+
+// Gives the new directory `ip` its first block, with the "." and ".."
+// entries.
+static bool mkdirblock(ext2_incore *ip, u32 parent)
+{
+    ext2fs *fs = ip->fs;
+    u32 goal = goalfor(ip, 0);
+    u32 got;
+    u32 pblk = ext2_iballoc(ip, goal, 1, &got);
+    if (!pblk) {
+        printf("Error: ext2: No free blocks\n");
+        return false;
+    }
+    ext2_setmap(ip, 0, pblk, &goal);
+    ip->inode.size_lo = fs->blksize;
+    ip->inode.sectors += fs->blksize / 512;
+
+    // A block of one unused entry, which the entries are then added to.
+    buffer *bp = bget(fs->dev, pblk, fs->blksize);
+    if (!bp) {
+        return false;
+    }
+    memset(bp->data, 0, fs->blksize);
+    putle16((u8*)&bp->data[offsetof(ext2_dir_entry, reclen)], fs->blksize);
+    bdirty(bp);
+    brelse(bp);
+
+    return ext2_diradd(ip, ".", 1, ip->ino, EXT2_S_IFDIR) &&
+            ext2_diradd(ip, "..", 2, parent, EXT2_S_IFDIR);
+}
+
+ext2_incore *ext2_create(ext2_incore *dir, const char *name, u32 len,
+        u16 mode)
+{
+    ext2fs *fs = dir->fs;
+    u32 exists;
+    if (!fs->writable || (dir->inode.mode & EXT2_S_IFMT) != EXT2_S_IFDIR ||
+            len == 0 || len > EXT2_NAME_MAX ||
+            !ext2_lookup(dir, name, len, &exists) || exists) {
+        return 0;
+    }
+
+    bool isdir = (mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+    u32 ino = ext2_ialloc(fs, dir->ino, isdir);
+    if (!ino) {
+        printf("Error: ext2: No free inodes\n");
+        return 0;
+    }
+    ext2_incore *ip = ext2_iget(fs, ino);
+    if (!ip) {
+        ext2_ifree(fs, ino, isdir);
+        return 0;
+    }
+
+    // Nothing of the inode's previous life is kept but its generation.
+    u32 generation = ip->inode.generation + 1;
+    ip->inode = (ext2_inode) {
+        .mode = mode,
+        .numlinks = isdir ? 2 : 1,
+        .generation = generation,
+    };
+    ip->bmap = (ext2_bmapcache) { 0 };
+    ext2_idirty(ip);
+
+    if ((isdir && !mkdirblock(ip, dir->ino)) ||
+            !ext2_diradd(dir, name, len, ino, mode)) {
+        ip->inode.numlinks = 0;
+        ip->orphan = true;
+        ext2_iput(ip);
+        return 0;
+    }
+    if (isdir) {
+        // The new directory's "..".
+        dir->inode.numlinks++;
+        ext2_idirty(dir);
+    }
+    ext2_dset(fs, dir->ino, name, len, ino);
+
+    maybesync(fs);
+    return ip;
+}
+
+bool ext2_unlink(ext2_incore *dir, const char *name, u32 len)
+{
+    ext2fs *fs = dir->fs;
+    if (!fs->writable || (dir->inode.mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return false;
+    }
+    u32 ino;
+    if (!ext2_lookup(dir, name, len, &ino)) {
+        return false;
+    }
+    ext2_incore *ip = ino ? ext2_iget(fs, ino) : 0;
+    if (!ip) {
+        return false;
+    }
+
+    // Directories would have to be empty, and their parent's link count
+    // updated. We don't remove them.
+    if ((ip->inode.mode & EXT2_S_IFMT) == EXT2_S_IFDIR ||
+            !ext2_dirremove(dir, name, len)) {
+        ext2_iput(ip);
+        return false;
+    }
+    ext2_dset(fs, dir->ino, name, len, 0);
+
+    if (ip->inode.numlinks && --ip->inode.numlinks == 0) {
+        // Deleted on the last ext2_iput().
+        ip->orphan = true;
+    }
+    ext2_idirty(ip);
+    ext2_iput(ip);
+
+    maybesync(fs);
+    return true;
+}
+
+void ext2_idelete(ext2_incore *ip)
+{
+    ext2_inode *inode = &ip->inode;
+    u16 type = inode->mode & EXT2_S_IFMT;
+    ip->orphan = false;
+    dropdelayed(ip, 0);
+
+    // Short symbolic links keep their target in the block pointers.
+    if (type != EXT2_S_IFLNK || inode->sectors) {
+        ext2_itrunc(ip, 0);
+    }
+    inode->size_lo = 0;
+    // Any deletion time marks the inode as deleted, but small ones link the
+    // ext3 orphan list. Without a clock, the superblock's last write time
+    // stands in for now.
+    u32 now = ip->fs->sblock.writtentime;
+    inode->deltime = now ? now : 1;
+    ext2_idirty(ip);
+    ext2_ifree(ip->fs, ip->ino, type == EXT2_S_IFDIR);
+}
+
+void ext2_wstats(ext2_write_stats *out)
+{
+    *out = stats;
+}
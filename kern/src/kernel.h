@@ -18,10 +18,13 @@
 #define PACKED __attribute__((packed))
 #define ALIGNED(n) __attribute__((aligned(n)))
 #define INTERRUPT __attribute__((interrupt))
+#define UNUSED __attribute__((unused))
 #ifdef __i386__
 struct interrupt_frame;
 #define INTERRUPT_ARGS struct interrupt_frame*
+#define SIMD __attribute__((target("sse2")))
 #else
+#define SIMD
 #define INTERRUPT_ARGS void
 #endif
 #endif
@@ -44,10 +47,54 @@ void writeble(u8 *buf, const char *fmt, ...);
 void puts(const char *msg);
 void printf(const char *fmt, ...);
 
+typedef struct {
+    u32 chars;      // Characters printed.
+    u32 flushes;    // Copies of changed lines to the screen.
+    u32 lines;      // Lines copied.
+    u32 regs;       // Cursor and start address register writes.
+    u32 scrolls;
+    u32 wraps;      // Times the screen went back to the top of video memory.
+} console_stats;
+
+// Console outputs, both by default.
+#define CONSOLE_VGA 0x1
+#define CONSOLE_SERIAL 0x2
+
+// Selects where console output goes.
+void console_setoutputs(unsigned which);
+// Console output reaches the screen on the next timer tick, or right away if
+// printed with interrupts disabled. Writes it out now.
+void console_flush(void);
+// Shows the screen as it was `lines` lines further up, as far as the
+// scrollback goes. 0 goes back to the current output.
+void console_scrollback(u32 lines);
+void console_getstats(console_stats *stats);
+
 void setirq(u8 irq, interrupt_handler *func);
 void remirq(u8 irq);
 void sendeoi(u8 irq);
 
 void msleep(unsigned millis);
+// Milliseconds since the timer was started.
+u32 ticks(void);
+
+// Waits for the next interrupt. Interrupts must be enabled.
+void idle(void);
+// Disables interrupts. Returns the previous state for irqrestore().
+u32 irqsave(void);
+// Enables interrupts again if they were enabled before irqsave().
+void irqrestore(u32 flags);
+
+// The kernel is built without floating point and SIMD registers, except for
+// functions marked SIMD and files named *_simd.c. Their code may only run
+// between kernel_fpu_begin() and kernel_fpu_end(), and only if
+// kernel_fpu_usable(), which is false if the CPU lacks SIMD support or a
+// region is already active (e.g. in an interrupt handler that interrupted
+// one). Call them from an ordinary function, around a call to the SIMD one,
+// so that the compiler can't move SIMD instructions out of the region. Keep
+// interrupt handlers free of SIMD code.
+bool kernel_fpu_usable(void);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
 
 #endif
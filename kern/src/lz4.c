@@ -0,0 +1,211 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * lz4.c
+ * LZ4 frame decompression
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#include "lz4.h"
+
+#include "kernel.h"
+#include "bio.h"
+#include "mem.h"
+
+#define MAGIC 0x184d2204
+
+// Frame descriptor flags.
+#define FLG_VERSION 0xc0
+#define FLG_VERSION_1 0x40
+#define FLG_INDEPENDENT 0x20
+#define FLG_BLOCKCSUM 0x10
+#define FLG_SIZE 0x08
+#define FLG_DICTID 0x01
+
+#define BLOCK_STORED 0x80000000
+
+#define MINMATCH 4
+
+// Copies 8 bytes. Sequences are copied 8 bytes at a time, which may write
+// past their end, as long as there is room for it.
+static inline void copy8(u8 *dst, const u8 *src)
+{
+    __builtin_memcpy(dst, src, 8);
+}
+
+bool lz4_isframe(const void *src, u32 len)
+{
+    return len >= 4 && getle32(src) == MAGIC;
+}
+
+bool lz4_open(lz4_frame *f, const void *src, u32 len)
+{
+    const u8 *p = src;
+    if (!lz4_isframe(src, len) || len < 7) {
+        return false;
+    }
+
+    u8 flg = p[4];
+    u8 bd = p[5];
+    if ((flg & FLG_VERSION) != FLG_VERSION_1 || (flg & FLG_DICTID)) {
+        printf("Error: lz4: unsupported frame (flags %x)\n", flg);
+        return false;
+    }
+    unsigned sizeid = (bd >> 4) & 7;
+    if (sizeid < 4) {
+        printf("Error: lz4: bad block size\n");
+        return false;
+    }
+
+    *f = (lz4_frame) {
+        .src = src,
+        .srclen = len,
+        .pos = 6,
+        .blockmax = 1 << (8 + 2 * sizeid),  // 64K, 256K, 1M, 4M
+        .independent = flg & FLG_INDEPENDENT,
+        .blockcsum = flg & FLG_BLOCKCSUM,
+        .hassize = flg & FLG_SIZE,
+    };
+    if (f->hassize) {
+        if (len < 15) {
+            return false;
+        }
+        f->size = getle64(&p[6]);
+        f->pos += 8;
+    }
+    f->pos++;           // Header checksum.
+    return true;
+}
+
+bool lz4_next(lz4_frame *f, lz4_block *blk)
+{
+    if (f->srclen - f->pos < 4) {
+        return false;
+    }
+    u32 word = getle32(&f->src[f->pos]);
+    if (word == 0) {
+        return false;   // End mark.
+    }
+
+    u32 len = word & ~BLOCK_STORED;
+    u32 next = f->pos + 4 + len + (f->blockcsum ? 4 : 0);
+    if (len > f->blockmax || next > f->srclen || next < f->pos) {
+        printf("Error: lz4: truncated frame\n");
+        return false;
+    }
+
+    *blk = (lz4_block) {
+        .data = &f->src[f->pos + 4],
+        .len = len,
+        .stored = word & BLOCK_STORED,
+    };
+    f->pos = next;
+    return true;
+}
+
+// Reads the rest of a length that doesn't fit into its 4 bits of the token.
+static bool extend(const u8 **ip, const u8 *iend, u32 *len)
+{
+    u8 b;
+    do {
+        if (*ip == iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+s32 lz4_decode(const lz4_block *blk, u8 *dst, u32 cap, const u8 *dict)
+{
+    const u8 *ip = blk->data;
+    const u8 *iend = ip + blk->len;
+    u8 *op = dst;
+    u8 *oend = dst + cap;
+
+    if (blk->stored) {
+        if (blk->len > cap) {
+            return -1;
+        }
+        memcpy(op, ip, blk->len);
+        return blk->len;
+    }
+
+    // A block is a sequence of literals, each followed by a match (a copy
+    // of earlier output), except for the last one. Every step checks that it
+    // stays within both buffers, so `ip <= iend` and `op <= oend` hold
+    // throughout.
+    while (ip < iend) {
+        u8 token = *ip++;
+
+        u32 len = token >> 4;
+        if (len == 15 && !extend(&ip, iend, &len)) {
+            return -1;
+        }
+        if (len > (u32)(iend - ip) || len > (u32)(oend - op)) {
+            return -1;
+        }
+        if ((u32)(iend - ip) >= len + 8 && (u32)(oend - op) >= len + 8) {
+            for (u32 i = 0; i < len; i += 8) {
+                copy8(op + i, ip + i);
+            }
+        } else {
+            memcpy(op, ip, len);
+        }
+        ip += len;
+        op += len;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        u32 offset = getle16(ip);
+        ip += 2;
+        len = token & 15;
+        if (len == 15 && !extend(&ip, iend, &len)) {
+            return -1;
+        }
+        len += MINMATCH;
+        if (offset == 0 || offset > (u32)(op - dict) ||
+                len > (u32)(oend - op)) {
+            return -1;
+        }
+
+        // Matches may overlap their own output (e.g. offset 1 repeats a
+        // byte), in which case they must be copied byte by byte.
+        const u8 *match = op - offset;
+        if (offset >= 8 && (u32)(oend - op) >= len + 8) {
+            for (u32 i = 0; i < len; i += 8) {
+                copy8(op + i, match + i);
+            }
+        } else {
+            for (u32 i = 0; i < len; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += len;
+    }
+    return op - dst;
+}
+
+s32 lz4_decodeframe(lz4_frame *f, u8 *dst, u32 cap)
+{
+    lz4_block blk;
+    u32 done = 0;
+    while (lz4_next(f, &blk)) {
+        // Dependent blocks may refer back up to 64K into the blocks before.
+        s32 n = lz4_decode(&blk, &dst[done], cap - done,
+                f->independent ? &dst[done] : dst);
+        if (n < 0) {
+            printf("Error: lz4: corrupt block at %u\n", f->pos);
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
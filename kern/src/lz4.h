@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * lz4.h
+ * LZ4 frame decompression
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "kernel.h"
+
+// An LZ4 frame (as written by the `lz4` tool) is a header followed by blocks
+// of compressed data, each of which decompresses to at most `blockmax`
+// bytes. Only the last block may be shorter. Blocks are either independent
+// or may refer back to the data of the blocks before them.
+typedef struct lz4_frame {
+    const u8 *src;
+    u32 srclen;
+    u32 pos;            // Offset of the next block in `src`.
+    u32 blockmax;
+    bool independent;
+    bool blockcsum;     // Blocks are followed by a checksum.
+    bool hassize;
+    u64 size;           // Decompressed size, if `hassize`.
+} lz4_frame;
+
+// A block of a frame.
+typedef struct {
+    const u8 *data;
+    u32 len;
+    bool stored;        // Stored uncompressed.
+} lz4_block;
+
+// Whether `src` starts with an LZ4 frame.
+bool lz4_isframe(const void *src, u32 len);
+// Parses the frame header. Returns false if it is not a frame we can read.
+// Checksums are not verified.
+bool lz4_open(lz4_frame *f, const void *src, u32 len);
+// Gets the next block. Returns false at the end of the frame or if the frame
+// is truncated.
+bool lz4_next(lz4_frame *f, lz4_block *blk);
+// Decompresses `blk` to `dst`, which has room for `cap` bytes. Matches may
+// refer back as far as `dict`, for blocks that depend on the ones before
+// them; pass `dst` for independent blocks. Returns the number of bytes
+// written, or -1 if the data is corrupt or doesn't fit.
+s32 lz4_decode(const lz4_block *blk, u8 *dst, u32 cap, const u8 *dict);
+// Decompresses a whole frame in one pass. Returns the number of bytes
+// written, or -1 on error.
+s32 lz4_decodeframe(lz4_frame *f, u8 *dst, u32 cap);
+
+#endif
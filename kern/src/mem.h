@@ -0,0 +1,43 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * mem.h
+ * Memory copy, fill and compare
+ *
+ * Copyright (C) 2024-present Ben Matthies
+ * This is free software under the GNU General Public License, version 3, or,
+ * at your option, any later version. See LICENSE file for details.
+ */
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+#include "kernel.h"
+
+// The usual C library functions (see arch/.../mem.c). The compiler may also
+// call them on its own, e.g. to copy large structures.
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+void *memset(void *dst, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+
+// Copies and fills of a small size known at compile time (field copies,
+// clearing a structure) are cheaper done inline, with a few moves, than
+// with a call. The compiler does that for its builtins.
+#define MEM_INLINE_MAX 64
+
+#define memcpy(dst, src, n) \
+    (__builtin_constant_p(n) && (n) <= MEM_INLINE_MAX ? \
+            __builtin_memcpy(dst, src, n) : (memcpy)(dst, src, n))
+#define memmove(dst, src, n) \
+    (__builtin_constant_p(n) && (n) <= MEM_INLINE_MAX ? \
+            __builtin_memmove(dst, src, n) : (memmove)(dst, src, n))
+#define memset(dst, c, n) \
+    (__builtin_constant_p(n) && (n) <= MEM_INLINE_MAX ? \
+            __builtin_memset(dst, c, n) : (memset)(dst, c, n))
+#define memcmp(a, b, n) \
+    (__builtin_constant_p(n) && (n) <= MEM_INLINE_MAX ? \
+            __builtin_memcmp(a, b, n) : (memcmp)(a, b, n))
+
+#endif